@@ -0,0 +1,378 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "upnpglobalvars.h"
+#include "browsecache.h"
+#include "utils.h"
+
+#define BUCKETS	1024
+/* No one response may take more than this share of the cache */
+#define MAX_SHARE	8
+/* Seconds to wait for a request in flight before answering alone */
+#define FLIGHT_WAIT	10
+
+struct entry {
+	struct entry *next;	/* in its bucket */
+	struct entry *newer, *older;
+	unsigned int hash;
+	uint32_t update_id;
+	size_t keylen;
+	size_t len;
+	char data[];		/* the key, then the response */
+};
+
+/* A request being answered, and those waiting for its response */
+struct flight {
+	struct flight *next;
+	unsigned int hash;
+	uint32_t update_id;
+	int done;
+	int waiters;
+	char *body;
+	size_t len;
+	pthread_cond_t cond;
+	size_t keylen;
+	char key[];
+};
+
+static struct entry *buckets[BUCKETS];
+static struct flight *flights;
+static struct entry *newest, *oldest;
+static struct browse_cache_stats stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t
+browse_cache_key(char *key, const char *object_id, const char *browse_flag,
+                 int start, int count, uint32_t filter,
+                 const char *sort, int iface)
+{
+	int len;
+
+	/* NUL separated, as none of the strings can hold one */
+	len = snprintf(key, BROWSE_CACHE_KEY_LEN, "%s%c%s%c%d%c%d%c%x%c%s%c%d",
+	               object_id, 0, browse_flag, 0, start, 0, count, 0,
+	               filter, 0, sort ? sort : "", 0, iface);
+	if (len < 0 || len >= BROWSE_CACHE_KEY_LEN)
+		return 0;
+
+	return len;
+}
+
+static inline size_t
+entry_size(const struct entry *e)
+{
+	return sizeof(*e) + e->keylen + e->len;
+}
+
+static void
+unlink_lru(struct entry *e)
+{
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		oldest = e->newer;
+}
+
+static void
+link_newest(struct entry *e)
+{
+	e->newer = NULL;
+	e->older = newest;
+	if (newest)
+		newest->newer = e;
+	newest = e;
+	if (!oldest)
+		oldest = e;
+}
+
+static void
+remove_entry(struct entry *e)
+{
+	struct entry **p;
+
+	for (p = &buckets[e->hash % BUCKETS]; *p != e; p = &(*p)->next)
+		;
+	*p = e->next;
+	unlink_lru(e);
+	stats.entries--;
+	stats.bytes -= entry_size(e);
+	free(e);
+}
+
+static void
+flush(void)
+{
+	while (oldest)
+		remove_entry(oldest);
+}
+
+static struct entry *
+find(const char *key, size_t keylen, unsigned int hash)
+{
+	struct entry *e;
+
+	for (e = buckets[hash % BUCKETS]; e; e = e->next)
+	{
+		if (e->hash == hash && e->keylen == keylen && memcmp(e->data, key, keylen) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct flight *
+find_flight(const char *key, size_t keylen, unsigned int hash)
+{
+	struct flight *f;
+
+	for (f = flights; f; f = f->next)
+	{
+		if (f->hash == hash && f->keylen == keylen && memcmp(f->key, key, keylen) == 0)
+			return f;
+	}
+
+	return NULL;
+}
+
+static void
+free_flight(struct flight *f)
+{
+	pthread_cond_destroy(&f->cond);
+	free(f->body);
+	free(f);
+}
+
+/* The request in flight is answered, or not if body is NULL */
+static void
+land(const char *key, size_t keylen, const char *body, size_t len)
+{
+	unsigned int hash = DJBHash((uint8_t *)key, keylen);
+	struct flight **p, *f;
+
+	for (p = &flights; *p; p = &(*p)->next)
+	{
+		f = *p;
+		if (f->hash != hash || f->keylen != keylen || memcmp(f->key, key, keylen) != 0)
+			continue;
+		*p = f->next;
+		f->done = 1;
+		if (body && f->waiters && (f->body = malloc(len)))
+		{
+			memcpy(f->body, body, len);
+			f->len = len;
+		}
+		if (f->waiters)
+			pthread_cond_broadcast(&f->cond);
+		else
+			free_flight(f);
+		return;
+	}
+}
+
+static struct flight *
+take_off(const char *key, size_t keylen, unsigned int hash, uint32_t update_id)
+{
+	struct flight *f;
+
+	f = calloc(1, sizeof(*f) + keylen);
+	if (!f)
+		return NULL;
+	f->hash = hash;
+	f->update_id = update_id;
+	pthread_cond_init(&f->cond, NULL);
+	f->keylen = keylen;
+	memcpy(f->key, key, keylen);
+	f->next = flights;
+	flights = f;
+
+	return f;
+}
+
+char *
+browse_cache_get(const char *key, size_t keylen, uint32_t update_id,
+                 size_t *len, int *leader)
+{
+	unsigned int hash;
+	struct entry *e;
+	struct flight *f;
+	struct timespec deadline;
+	char *body = NULL;
+	int ret = 0;
+
+	*leader = 0;
+	if (!keylen)
+		return NULL;
+
+	hash = DJBHash((uint8_t *)key, keylen);
+	pthread_mutex_lock(&lock);
+	e = find(key, keylen, hash);
+	if (e && e->update_id == update_id && (body = malloc(e->len)))
+	{
+		memcpy(body, e->data + e->keylen, e->len);
+		*len = e->len;
+		unlink_lru(e);
+		link_newest(e);
+		stats.hits++;
+		pthread_mutex_unlock(&lock);
+		return body;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += FLIGHT_WAIT;
+	while ((f = find_flight(key, keylen, hash)) && f->update_id == update_id)
+	{
+		f->waiters++;
+		while (!f->done && ret != ETIMEDOUT)
+			ret = pthread_cond_timedwait(&f->cond, &lock, &deadline);
+		if (f->body && (body = malloc(f->len)))
+		{
+			memcpy(body, f->body, f->len);
+			*len = f->len;
+		}
+		if (--f->waiters == 0 && f->done)
+			free_flight(f);
+		if (body)
+		{
+			stats.coalesced++;
+			pthread_mutex_unlock(&lock);
+			return body;
+		}
+		if (ret == ETIMEDOUT)
+			break;
+		/* It gave up, see if someone else is trying */
+	}
+	stats.misses++;
+
+	/* Take off, unless someone else is on another UpdateID */
+	if (!f && take_off(key, keylen, hash, update_id))
+		*leader = 1;
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+int
+browse_cache_claim(const char *key, size_t keylen, uint32_t update_id)
+{
+	unsigned int hash;
+	struct entry *e;
+	int ret = 0;
+
+	if (!keylen)
+		return 0;
+
+	hash = DJBHash((uint8_t *)key, keylen);
+	pthread_mutex_lock(&lock);
+	e = find(key, keylen, hash);
+	if ((!e || e->update_id != update_id) &&
+	    !find_flight(key, keylen, hash) && take_off(key, keylen, hash, update_id))
+		ret = 1;
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+void
+browse_cache_put(const char *key, size_t keylen, uint32_t update_id,
+                 const char *body, size_t len)
+{
+	size_t max = runtime_vars.browse_cache_size > 0 ? runtime_vars.browse_cache_size : 0;
+	unsigned int hash;
+	struct entry *e = NULL, *old;
+
+	if (!keylen)
+		return;
+	if (sizeof(*e) + keylen + len <= max / MAX_SHARE)
+		e = malloc(sizeof(*e) + keylen + len);
+	if (!e)
+	{
+		pthread_mutex_lock(&lock);
+		land(key, keylen, body, len);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	e->hash = hash = DJBHash((uint8_t *)key, keylen);
+	e->update_id = update_id;
+	e->keylen = keylen;
+	e->len = len;
+	memcpy(e->data, key, keylen);
+	memcpy(e->data + keylen, body, len);
+
+	pthread_mutex_lock(&lock);
+	land(key, keylen, body, len);
+	/* Built by another thread meanwhile, or replacing what the container
+	 * listed before it changed */
+	if ((old = find(key, keylen, hash)))
+	{
+		if (old->update_id == update_id)
+		{
+			pthread_mutex_unlock(&lock);
+			free(e);
+			return;
+		}
+		remove_entry(old);
+	}
+	while (oldest && stats.bytes + entry_size(e) > max)
+	{
+		remove_entry(oldest);
+		stats.evictions++;
+	}
+	e->next = buckets[hash % BUCKETS];
+	buckets[hash % BUCKETS] = e;
+	link_newest(e);
+	stats.entries++;
+	stats.bytes += entry_size(e);
+	pthread_mutex_unlock(&lock);
+}
+
+void
+browse_cache_abandon(const char *key, size_t keylen)
+{
+	if (!keylen)
+		return;
+	pthread_mutex_lock(&lock);
+	land(key, keylen, NULL, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+void
+browse_cache_clear(void)
+{
+	pthread_mutex_lock(&lock);
+	flush();
+	pthread_mutex_unlock(&lock);
+}
+
+void
+browse_cache_get_stats(struct browse_cache_stats *out)
+{
+	pthread_mutex_lock(&lock);
+	*out = stats;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,93 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BROWSECACHE_H__
+#define __BROWSECACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Complete Browse response bodies, kept in least recently used order within
+ * runtime_vars.browse_cache_size bytes.  Clients ask for the same pages of
+ * a folder each time they go back into it.  Entries are only good for the
+ * UpdateID they were built under, that of the container they list, so a
+ * change elsewhere in the library leaves them be.
+ *
+ * Requests that miss are also coalesced: while one is being answered,
+ * identical ones wait for its response instead of building their own. */
+
+#define BROWSE_CACHE_KEY_LEN	1024
+
+struct browse_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long coalesced;	/* answered by another request in flight */
+	size_t entries;
+	size_t bytes;
+};
+
+/**
+ * Build the key of a Browse request.
+ * @return The length of the key, 0 if it does not fit in BROWSE_CACHE_KEY_LEN
+ *         and the request cannot be cached.
+ */
+size_t browse_cache_key(char *key, const char *object_id, const char *browse_flag,
+                        int start, int count, uint32_t filter,
+                        const char *sort, int iface);
+
+/**
+ * Look a response up, waiting for it if an identical request is being
+ * answered.
+ * @param update_id The UpdateID of the container the request lists.
+ * @param len Filled with the length of the response.
+ * @param leader Set to 1 if the caller is now the one answering the
+ *        request, and must call browse_cache_put() or browse_cache_abandon()
+ *        once done.  Set to 0 otherwise.
+ * @return A copy of the response, to be freed with free(), or NULL.
+ */
+char *browse_cache_get(const char *key, size_t keylen, uint32_t update_id,
+                       size_t *len, int *leader);
+
+/**
+ * Start answering a request ahead of time, as long as it is neither cached
+ * nor being answered.  Never waits.
+ * @return 1 if the caller is now the one answering the request, as with
+ *         browse_cache_get(), 0 otherwise.
+ */
+int browse_cache_claim(const char *key, size_t keylen, uint32_t update_id);
+
+/**
+ * Keep a response, and hand it to the requests waiting for it.
+ * @param update_id The UpdateID of the container when the response was
+ *        started.
+ */
+void browse_cache_put(const char *key, size_t keylen, uint32_t update_id,
+                      const char *body, size_t len);
+
+/**
+ * Give up answering a request, letting one of those waiting on it try.
+ */
+void browse_cache_abandon(const char *key, size_t keylen);
+
+/**
+ * Drop everything, keeping the counters.
+ */
+void browse_cache_clear(void);
+
+void browse_cache_get_stats(struct browse_cache_stats *stats);
+
+#endif // __BROWSECACHE_H__
@@ -0,0 +1,394 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "didl.h"
+#include "utils.h"
+
+/* A string literal and its length */
+#define LIT(lit)	lit, sizeof(lit) - 1
+#define APPEND(w, lit)	append((w)->str, (w)->max, LIT(lit))
+
+int
+didl_reserve(struct string_s *str, size_t len, size_t max)
+{
+	size_t size;
+	char *data;
+
+	if (str->off + len <= str->size)
+		return 0;
+	if (str->off + len > max)
+		return -1;
+	size = str->size ? str->size : 1024;
+	while (size < str->off + len)
+		size *= 2;
+	if (size > max)
+		size = max;
+	data = realloc(str->data, size);
+	if (!data)
+		return -1;
+	str->data = data;
+	str->size = size;
+
+	return 0;
+}
+
+static inline int
+append(struct string_s *str, size_t max, const char *text, size_t len)
+{
+	if (didl_reserve(str, len, max) != 0)
+		return -1;
+	memcpy(str->data + str->off, text, len);
+	str->off += len;
+
+	return 0;
+}
+
+static inline int
+append_str(struct didl_writer *w, const char *text)
+{
+	return append(w->str, w->max, text, strlen(text));
+}
+
+#define INT_LEN	21	/* "-9223372036854775808" and its NUL */
+
+/* Format n at the end of buf, returning where it starts */
+static char *
+format_int(char buf[INT_LEN], int64_t n)
+{
+	char *p = buf + INT_LEN - 1;
+	uint64_t u = n < 0 ? -(uint64_t)n : (uint64_t)n;
+
+	*p = '\0';
+	do
+		*--p = '0' + u % 10;
+	while (u /= 10);
+	if (n < 0)
+		*--p = '-';
+
+	return p;
+}
+
+static int
+append_int(struct didl_writer *w, int64_t n)
+{
+	char buf[INT_LEN], *p = format_int(buf, n);
+
+	return append(w->str, w->max, p, buf + INT_LEN - 1 - p);
+}
+
+/* Stored fragments are DIDL-Lite with a few control bytes, which never
+ * appear in escaped text:
+ *   URL_MARK        the media URL up to the extension, host and port
+ *                   being those of the interface the request came in on
+ *   OPEN_MARK flag  what follows up to the matching CLOSE_MARK is only
+ *                   written when the Filter asks for that flag */
+#define URL_MARK	'\x1d'
+#define OPEN_MARK	'\x1e'
+#define CLOSE_MARK	'\x1f'
+#define MEDIA_URL	"\x1d"
+#define SECTION(flag)	"\x1e" flag
+#define END_SECTION	"\x1f"
+
+static const struct
+{
+	char mark;
+	uint32_t flags;
+}
+sections[] =
+{
+	{ 'r', FILTER_RES },
+	{ 's', FILTER_RES_SIZE },
+	{ 0, 0 }
+};
+
+/* How many bytes at the start of text need no escaping */
+static size_t
+plain_span(const char *text, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+		                         _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, quot)));
+		/* and bytes up to 0x1f, which XML does not allow */
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+		int bits = _mm_movemask_epi8(m);
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+#endif
+	for (; i < len; i++)
+	{
+		if (text[i] == '&' || text[i] == '<' || text[i] == '>' || text[i] == '"' ||
+		    (unsigned char)text[i] <= 0x1f)
+			break;
+	}
+
+	return i;
+}
+
+int
+didl_escape(struct string_s *str, size_t max, const char *text)
+{
+	size_t len = strlen(text);
+	size_t span;
+	const char *entity;
+
+	/* No entity is longer than 10 bytes, so the copy below needs no
+	 * more checks */
+	if (didl_reserve(str, len * 10, max) != 0)
+		return -1;
+
+	while (len)
+	{
+		span = plain_span(text, len);
+		memcpy(str->data + str->off, text, span);
+		str->off += span;
+		text += span;
+		len -= span;
+		if (!len)
+			break;
+		switch (*text)
+		{
+		case '&': entity = "&amp;amp;"; break;
+		case '<': entity = "&amp;lt;"; break;
+		case '>': entity = "&amp;gt;"; break;
+		case '"': entity = "&amp;quot;"; break;
+		/* control characters are dropped */
+		default: entity = ""; break;
+		}
+		span = strlen(entity);
+		memcpy(str->data + str->off, entity, span);
+		str->off += span;
+		text++;
+		len--;
+	}
+
+	return 0;
+}
+
+char *
+didl_fragment(const char *class, const char *title, const char *mime, const char *size)
+{
+	struct string_s str = { NULL, 0, 0 };
+	size_t max = DIDL_FRAGMENT_MAX;
+	const char *ext;
+	int ret;
+
+	ret = append(&str, max, LIT("&gt;&lt;dc:title&gt;"));
+	ret |= didl_escape(&str, max, title ? title : "");
+	ret |= append(&str, max, LIT("&lt;/dc:title&gt;&lt;upnp:class&gt;object."));
+	ret |= append(&str, max, class, strlen(class));
+	ret |= append(&str, max, LIT("&lt;/upnp:class&gt;"));
+	if (strncmp(class, "item", 4) == 0 && mime)
+	{
+		ext = mime_to_ext(mime);
+		ret |= append(&str, max, LIT(SECTION("r") "&lt;res "));
+		if (size)
+		{
+			ret |= append(&str, max, LIT(SECTION("s") "size=\""));
+			ret |= append(&str, max, size, strlen(size));
+			ret |= append(&str, max, LIT("\" " END_SECTION));
+		}
+		ret |= append(&str, max, LIT("protocolInfo=\"http-get:*:"));
+		ret |= append(&str, max, mime, strlen(mime));
+		ret |= append(&str, max, LIT(":*\"&gt;" MEDIA_URL "."));
+		ret |= append(&str, max, ext, strlen(ext));
+		ret |= append(&str, max, LIT("&lt;/res&gt;" END_SECTION));
+	}
+	ret |= append(&str, max, "", 1);
+	if (ret)
+	{
+		free(str.data);
+		return NULL;
+	}
+
+	return str.data;
+}
+
+void
+didl_init(struct didl_writer *w, struct string_s *str, size_t max,
+          uint32_t filter, const char *addr, int port)
+{
+	memset(w, 0, sizeof(*w));
+	w->str = str;
+	w->max = max;
+	w->filter = filter;
+	w->url_len = snprintf(w->url, sizeof(w->url), "http://%s:%d/MediaItems/", addr, port);
+	if (w->url_len >= sizeof(w->url))
+		w->url_len = sizeof(w->url) - 1;
+}
+
+/* How many bytes at the start of a fragment come before a mark or the end
+ * of it, both of which are control bytes.  The aligned loads read past the
+ * end of the string, if never into another page, which ASan reports. */
+#if defined(__SANITIZE_ADDRESS__)
+__attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+# if __has_feature(address_sanitizer)
+__attribute__((no_sanitize_address))
+# endif
+#endif
+static size_t
+text_span(const char *frag)
+{
+#ifdef __SSE2__
+	/* Aligned loads never cross into a page the string is not in */
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+	size_t misalign = (uintptr_t)frag & 15;
+	const __m128i *p = (const __m128i *)(frag - misalign);
+	__m128i v = _mm_load_si128(p);
+	int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl)) >> misalign;
+
+	while (!bits)
+	{
+		v = _mm_load_si128(++p);
+		bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+		if (bits)
+			return (const char *)p - frag + __builtin_ctz(bits);
+	}
+	return __builtin_ctz(bits);
+#else
+	const char *p = frag;
+
+	while ((unsigned char)*p > 0x1f)
+		p++;
+	return p - frag;
+#endif
+}
+
+/* Copy a fragment, filling in the media URL and dropping the sections the
+ * Filter does not ask for */
+static int
+expand(struct didl_writer *w, const char *frag, int64_t key)
+{
+	int skip = 0, ret = 0, i;
+	size_t len;
+
+	for (;;)
+	{
+		len = text_span(frag);
+		if (!skip)
+			ret |= append(w->str, w->max, frag, len);
+		frag += len;
+		switch (*frag)
+		{
+		case URL_MARK:
+			if (!skip)
+			{
+				ret |= append(w->str, w->max, w->url, w->url_len);
+				ret |= append_int(w, key);
+			}
+			frag++;
+			break;
+		case OPEN_MARK:
+			if (!frag[1])
+				return ret;
+			for (i = 0; sections[i].mark && sections[i].mark != frag[1]; i++)
+				;
+			if (skip || !(w->filter & sections[i].flags))
+				skip++;
+			frag += 2;
+			break;
+		case CLOSE_MARK:
+			if (skip)
+				skip--;
+			frag++;
+			break;
+		default:
+			return ret;
+		}
+	}
+}
+
+int
+didl_write(struct didl_writer *w, const struct didl_object *obj)
+{
+	size_t start = w->str->off;
+	int item = (strncmp(obj->class, "item", 4) == 0);
+	int ret;
+
+	if (!item && strncmp(obj->class, "container", 9) != 0)
+		return 0;
+
+	ret = item ? APPEND(w, "&lt;item id=\"") : APPEND(w, "&lt;container id=\"");
+	ret |= append_str(w, obj->id);
+	ret |= APPEND(w, "\" parentID=\"");
+	ret |= append_str(w, obj->parent_id);
+	if (item)
+		ret |= APPEND(w, "\" restricted=\"1\"");
+	else
+	{
+		ret |= APPEND(w, "\" restricted=\"1\" ");
+		if (w->filter & FILTER_CHILDCOUNT)
+		{
+			ret |= APPEND(w, "childCount=\"");
+			ret |= append_int(w, obj->child_count >= 0 ? obj->child_count : 0);
+			ret |= APPEND(w, "\"");
+		}
+	}
+	if (obj->didl)
+		ret |= expand(w, obj->didl, obj->key);
+	else
+	{
+		/* Not rendered at scan time */
+		char size[INT_LEN], *frag;
+
+		frag = didl_fragment(obj->class, obj->title, obj->mime,
+		                     obj->size >= 0 ? format_int(size, obj->size) : NULL);
+		ret |= frag ? expand(w, frag, obj->key) : -1;
+		free(frag);
+	}
+
+	if (item)
+		ret |= APPEND(w, "&lt;/item&gt;");
+	else
+	{
+		if ((w->filter & FILTER_UPNP_STORAGEUSED) || strcmp(obj->class + 9, ".storageFolder") == 0)
+		{
+			ret |= APPEND(w, "&lt;upnp:storageUsed&gt;");
+			ret |= append_int(w, obj->storage_used);
+			ret |= APPEND(w, "&lt;/upnp:storageUsed&gt;");
+		}
+		ret |= APPEND(w, "&lt;/container&gt;");
+	}
+
+	if (ret)
+	{
+		w->str->off = start;
+		return -1;
+	}
+
+	return 0;
+}
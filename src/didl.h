@@ -0,0 +1,107 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DIDL_H__
+#define __DIDL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minidlnatypes.h"
+
+/* Standard DLNA/UPnP filter flags */
+#define FILTER_CHILDCOUNT			0x00000001
+#define FILTER_RES				0x00000040
+#define FILTER_RES_SIZE				0x00001000
+#define FILTER_UPNP_STORAGEUSED			0x00400000
+/* Masks */
+#define STANDARD_FILTER_MASK			0x00FFFFFF
+
+/* Bump when didl_fragment() output changes, to render stored fragments
+ * again */
+#define DIDL_VERSION		1
+#define DIDL_FRAGMENT_MAX	16384
+
+/* One row of OBJECTS.  Columns the Filter left out are NULL, or -1 for
+ * numbers. */
+struct didl_object
+{
+	const char *id;		/* ObjectID */
+	const char *parent_id;
+	int64_t key;		/* ID of the row, which names the media file */
+	const char *class;	/* without the "object." prefix */
+	const char *title;	/* as stored, not escaped */
+	const char *mime;
+	int64_t size;
+	int64_t child_count;
+	int64_t storage_used;
+	const char *didl;	/* from didl_fragment(), if stored */
+};
+
+/* Writes DIDL-Lite elements, escaped for the SOAP <Result> they go in,
+ * into a buffer that grows up to a limit. */
+struct didl_writer
+{
+	struct string_s *str;
+	size_t max;
+	uint32_t filter;
+	/* "http://addr:port/MediaItems/" */
+	char url[64];
+	size_t url_len;
+};
+
+/**
+ * Start writing DIDL-Lite into str, which must have been malloc()ed.
+ * @param w The writer.
+ * @param str The buffer, grown with realloc() as needed.
+ * @param max The largest the buffer may grow.
+ * @param filter The FILTER_* properties to write.
+ * @param addr The address media URLs point at.
+ * @param port The port media URLs point at.
+ */
+void didl_init(struct didl_writer *w, struct string_s *str, size_t max,
+               uint32_t filter, const char *addr, int port);
+
+/**
+ * Make room for len more bytes in a buffer.
+ * @return 0, or -1 if that would take it past max or out of memory.
+ */
+int didl_reserve(struct string_s *str, size_t len, size_t max);
+
+/**
+ * Append text escaped twice, once for DIDL-Lite and once for the SOAP
+ * envelope around it, so '&' becomes "&amp;amp;".  Control characters,
+ * which XML does not allow, are dropped.
+ * @return 0, or -1 if the buffer could not grow.
+ */
+int didl_escape(struct string_s *str, size_t max, const char *text);
+
+/**
+ * Render what can be known of an object at scan time: its title, class and
+ * resource, leaving out only the parts that depend on the interface asked
+ * and on the Filter.  didl_write() fills those in.
+ * @return The fragment, to be freed with free(), or NULL if out of memory.
+ */
+char *didl_fragment(const char *class, const char *title, const char *mime, const char *size);
+
+/**
+ * Write an item or container element.  Either all of it is written or,
+ * when the buffer is full, none of it.
+ * @return 0, or -1 if the buffer is full.
+ */
+int didl_write(struct didl_writer *w, const struct didl_object *obj);
+
+#endif // __DIDL_H__
@@ -24,6 +24,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "upnpglobalvars.h"
 #include "log.h"
@@ -62,6 +63,20 @@ log_close(void)
 		fclose(log_fp);
 }
 
+/* Hold the log stream across fork(), so a child forked from one thread
+ * can't inherit it locked by another */
+static void
+log_lock(void)
+{
+	flockfile(log_fp ? log_fp : stdout);
+}
+
+static void
+log_unlock(void)
+{
+	funlockfile(log_fp ? log_fp : stdout);
+}
+
 int find_matching_name(const char* str, const char* names[]) {
 	if (str == NULL) return -1;
 
@@ -86,6 +101,8 @@ log_init(const char *fname, const char *debug)
 	for (i=0; i<L_MAX; i++)
 		log_level[i] = default_log_level;
 
+	pthread_atfork(log_lock, log_unlock, log_unlock);
+
 	if (debug)
 	{
 		const char *rhs, *lhs, *nlhs;
@@ -136,16 +153,19 @@ log_err(int level, enum _log_facility facility, char *fname, int lineno, char *f
 	if (!log_fp)
 		log_fp = stdout;
 
+	/* keep lines from different threads in one piece */
+	flockfile(log_fp);
+
 	// timestamp
 	if (!GETFLAG(SYSTEMD_MASK))
 	{
 		time_t t;
-		struct tm *tm;
+		struct tm tm;
 		t = time(NULL);
-		tm = localtime(&t);
+		localtime_r(&t, &tm);
 		fprintf(log_fp, "[%04d/%02d/%02d %02d:%02d:%02d] ",
-		        tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-		        tm->tm_hour, tm->tm_min, tm->tm_sec);
+		        tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+		        tm.tm_hour, tm.tm_min, tm.tm_sec);
 	}
 
 	if (level)
@@ -158,11 +178,13 @@ log_err(int level, enum _log_facility facility, char *fname, int lineno, char *f
 	if (vfprintf(log_fp, fmt, ap) == -1)
 	{
 		va_end(ap);
+		funlockfile(log_fp);
 		return;
 	}
 	va_end(ap);
 
 	fflush(log_fp);
+	funlockfile(log_fp);
 
 	if (level==E_FATAL)
 		exit(-1);
@@ -87,6 +87,14 @@
 #include "minissdp.h"
 #include "minidlnatypes.h"
 #include "process.h"
+#include "streamer.h"
+#include "restart.h"
+#include "prefetch.h"
+#include "precompute.h"
+#include "soapworker.h"
+#include "upnpevents.h"
+#include "browsecache.h"
+#include "objtree.h"
 #include "scanner.h"
 #include "log.h"
 
@@ -95,10 +103,36 @@
 # define sqlite3_threadsafe() 0
 #endif
  
+LIST_HEAD(httplisthead, upnphttp);
+
+struct http_worker {
+	pthread_t thread;
+	sqlite3 *db;
+	int shttpl;		/* closed by the worker as it exits */
+	volatile time_t stop;	/* stop accepting, finish by this time */
+};
+
+/* seconds to finish open HTTP connections when handing over to a new
+ * instance */
+#define RESTART_DRAIN_TIME	5
+
+/* seconds without writes, or HTTP connections on the main thread, before
+ * the WAL is checkpointed */
+#define CHECKPOINT_IDLE	5
+/* pages the WAL may grow to before a commit checkpoints it anyway */
+#define WAL_AUTOCHECKPOINT	10000
+/* bytes the WAL is cut back to once checkpointed */
+#define WAL_SIZE_LIMIT	(4 * 1024 * 1024)
+
+static volatile sig_atomic_t restart_requested = 0;
+static volatile sig_atomic_t clear_cache_requested = 0;
+
 /* OpenAndConfHTTPSocket() :
- * setup the socket used to handle incoming HTTP connections. */
+ * setup the socket used to handle incoming HTTP connections.
+ * With reuseport set, several sockets can be bound to the same port and
+ * the kernel spreads incoming connections across them. */
 static int
-OpenAndConfHTTPSocket(unsigned short port)
+OpenAndConfHTTPSocket(unsigned short port, int reuseport)
 {
 	int s;
 	int i = 1;
@@ -113,6 +147,21 @@ OpenAndConfHTTPSocket(unsigned short port)
 
 	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) < 0)
 		DPRINTF(E_WARN, L_GENERAL, "setsockopt(http, SO_REUSEADDR): %s\n", strerror(errno));
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &i, sizeof(i)) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "setsockopt(http, SO_REUSEPORT): %s\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+#else
+	if (reuseport)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "SO_REUSEPORT is not supported\n");
+		close(s);
+		return -1;
+	}
+#endif
 
 	memset(&listenname, 0, sizeof(struct sockaddr_in));
 	listenname.sin_family = AF_INET;
@@ -126,7 +175,7 @@ OpenAndConfHTTPSocket(unsigned short port)
 		return -1;
 	}
 
-	if (listen(s, 16) < 0)
+	if (listen(s, runtime_vars.http_backlog) < 0)
 	{
 		DPRINTF(E_ERROR, L_GENERAL, "listen(http): %s\n", strerror(errno));
 		close(s);
@@ -136,6 +185,273 @@ OpenAndConfHTTPSocket(unsigned short port)
 	return s;
 }
 
+/* Add the HTTP connections that are waiting for data to readset.
+ * Returns the number of active connections. */
+static int
+http_fdset(struct httplisthead *head, fd_set *readset, int *max_fd)
+{
+	struct upnphttp *e;
+	int n = 0;
+
+	for (e = head->lh_first; e != NULL; e = e->entries.le_next)
+	{
+		if ((e->socket >= 0) && (e->state <= 2))
+		{
+			FD_SET(e->socket, readset);
+			*max_fd = MAX(*max_fd, e->socket);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* Process active HTTP connections, accept a new one on shttpl if there is
+ * one waiting, and delete the connections that are done. */
+static void
+http_process(struct httplisthead *head, fd_set *readset, int shttpl)
+{
+	struct upnphttp *e;
+	struct upnphttp *next;
+
+	for (e = head->lh_first; e != NULL; e = e->entries.le_next)
+	{
+		if ((e->socket >= 0) && (e->state <= 2) && (FD_ISSET(e->socket, readset)))
+			Process_upnphttp(e);
+	}
+	/* process incoming HTTP connections */
+	if (shttpl >= 0 && FD_ISSET(shttpl, readset))
+	{
+		int shttp;
+		socklen_t clientnamelen;
+		struct sockaddr_in clientname;
+		clientnamelen = sizeof(struct sockaddr_in);
+		shttp = accept(shttpl, (struct sockaddr *)&clientname, &clientnamelen);
+		if (shttp<0)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
+		}
+		else
+		{
+			struct upnphttp * tmp = 0;
+			char addr[INET_ADDRSTRLEN];
+			DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
+				inet_ntop(AF_INET, &clientname.sin_addr, addr, sizeof(addr)),
+				ntohs(clientname.sin_port) );
+			/*if (fcntl(shttp, F_SETFL, O_NONBLOCK) < 0) {
+				DPRINTF(E_ERROR, L_GENERAL, "fcntl F_SETFL, O_NONBLOCK\n");
+			}*/
+			/* Create a new upnphttp object and add it to
+			 * the active upnphttp object list */
+			tmp = New_upnphttp(shttp);
+			if (tmp)
+			{
+				tmp->clientaddr = clientname.sin_addr;
+				LIST_INSERT_HEAD(head, tmp, entries);
+			}
+			else
+			{
+				DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
+				close(shttp);
+			}
+		}
+	}
+	/* delete finished HTTP connections */
+	for (e = head->lh_first; e != NULL; e = next)
+	{
+		next = e->entries.le_next;
+		if(e->state >= 100)
+		{
+			LIST_REMOVE(e, entries);
+			Delete_upnphttp(e);
+		}
+	}
+}
+
+static void
+http_close_all(struct httplisthead *head)
+{
+	struct upnphttp *e;
+
+	while (head->lh_first != NULL)
+	{
+		e = head->lh_first;
+		LIST_REMOVE(e, entries);
+		Delete_upnphttp(e);
+	}
+}
+
+/* HTTP worker thread: serves the connections accepted on its own
+ * SO_REUSEPORT listener, using a read-only database connection from the
+ * pool. */
+static void *
+http_worker(void *arg)
+{
+	struct http_worker *w = arg;
+	struct httplisthead head;
+	fd_set readset;
+	struct timeval timeout;
+	int max_fd;
+
+	db = w->db;
+	LIST_INIT(&head);
+	while (!quitting)
+	{
+		if (w->stop && (!head.lh_first || time(NULL) >= w->stop))
+			break;
+		FD_ZERO(&readset);
+		max_fd = -1;
+		if (!w->stop)
+		{
+			FD_SET(w->shttpl, &readset);
+			max_fd = w->shttpl;
+		}
+		http_fdset(&head, &readset, &max_fd);
+
+		/* signals go to the main thread, so wake up now and then to
+		 * notice that we are quitting */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		if (select(max_fd+1, &readset, NULL, NULL, &timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			DPRINTF(E_ERROR, L_GENERAL, "select(http worker): %s\n", strerror(errno));
+			break;
+		}
+		http_process(&head, &readset, w->stop ? -1 : w->shttpl);
+	}
+
+	/* Left open, it would still be given its share of new connections */
+	close(__atomic_exchange_n(&w->shttpl, -1, __ATOMIC_ACQ_REL));
+	http_close_all(&head);
+	sql_reader_put(db);
+	db = NULL;
+
+	return NULL;
+}
+
+/* Start the HTTP worker threads, each with its own listener.  Listeners
+ * inherited from a previous instance are used first. */
+static struct http_worker *
+start_http_workers(int count, const int *inherited, int ninherited)
+{
+	struct http_worker *workers;
+	sigset_t set, oldset;
+	int i;
+
+	workers = calloc(count, sizeof(struct http_worker));
+	if (!workers)
+		DPRINTF(E_FATAL, L_GENERAL, "Allocation failed\n");
+
+	/* keep signal handling in the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	for (i = 0; i < count; i++)
+	{
+		/* Opened here, so a worker never runs without one */
+		workers[i].db = sql_reader_get();
+		if (!workers[i].db)
+			DPRINTF(E_FATAL, L_GENERAL, "HTTP worker failed to open database. EXITING\n");
+		if (i < ninherited)
+			workers[i].shttpl = inherited[i];
+		else
+			workers[i].shttpl = OpenAndConfHTTPSocket(runtime_vars.port, 1);
+		if (workers[i].shttpl < 0)
+			DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
+		if (pthread_create(&workers[i].thread, NULL, http_worker, &workers[i]) != 0)
+			DPRINTF(E_FATAL, L_GENERAL, "Failed to start HTTP worker. EXITING\n");
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	return workers;
+}
+
+/* Stop the HTTP worker threads, giving them drain seconds to finish the
+ * connections they already accepted. */
+static void
+stop_http_workers(struct http_worker *workers, int count, int drain)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		workers[i].stop = time(NULL) + drain;
+	for (i = 0; i < count; i++)
+		pthread_join(workers[i].thread, NULL);
+	free(workers);
+}
+
+/* Finish the connections in head without accepting new ones. */
+static void
+http_drain(struct httplisthead *head, int drain)
+{
+	time_t until = time(NULL) + drain;
+	struct timeval timeout;
+	fd_set readset;
+	int max_fd;
+
+	while (head->lh_first && !quitting && time(NULL) < until)
+	{
+		FD_ZERO(&readset);
+		max_fd = -1;
+		http_fdset(head, &readset, &max_fd);
+		if (soap_workers_fd() >= 0)
+		{
+			FD_SET(soap_workers_fd(), &readset);
+			max_fd = MAX(max_fd, soap_workers_fd());
+		}
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		if (select(max_fd+1, &readset, NULL, NULL, &timeout) < 0)
+		{
+			if (errno != EINTR)
+				break;
+			continue;
+		}
+		if (soap_workers_fd() >= 0 && FD_ISSET(soap_workers_fd(), &readset))
+			soap_workers_complete();
+		http_process(head, &readset, -1);
+	}
+	http_close_all(head);
+}
+
+/* Hot restart: hand our listeners to the new instance, finish what we are
+ * doing, then pass the transfers in progress over as well. */
+static void
+restart_handoff(int s, struct httplisthead *head, int *shttpl,
+                struct http_worker *workers, int *sssdp)
+{
+	int i, fd;
+
+	if (*shttpl >= 0)
+		restart_send_listener(s, RESTART_HTTP, *shttpl);
+	for (i = 0; workers && i < runtime_vars.http_workers; i++)
+	{
+		/* unless the worker has given up on it */
+		fd = __atomic_load_n(&workers[i].shttpl, __ATOMIC_ACQUIRE);
+		if (fd >= 0)
+			restart_send_listener(s, RESTART_HTTP, fd);
+	}
+	if (*sssdp >= 0)
+		restart_send_listener(s, RESTART_SSDP, *sssdp);
+	restart_send_listener(s, RESTART_READY, -1);
+
+	/* the new instance is accepting now */
+	if (*shttpl >= 0)
+		close(*shttpl);
+	*shttpl = -1;
+	if (*sssdp >= 0)
+		close(*sssdp);
+	*sssdp = -1;
+
+	http_drain(head, RESTART_DRAIN_TIME);
+	if (workers)
+		stop_http_workers(workers, runtime_vars.http_workers, RESTART_DRAIN_TIME);
+
+	streamer_handoff(s);
+	close(s);
+}
+
 /* Handler for the SIGTERM signal (kill) 
  * SIGINT is also handled */
 static void
@@ -153,6 +469,17 @@ sigusr1(int sig)
 {
 	signal(sig, sigusr1);
 	DPRINTF(E_WARN, L_GENERAL, "received signal %d, clear cache\n", sig);
+
+	clear_cache_requested = 1;
+}
+
+static void
+sigusr2(int sig)
+{
+	signal(sig, sigusr2);
+	DPRINTF(E_WARN, L_GENERAL, "received signal %d, hot restart\n", sig);
+
+	restart_requested = 1;
 }
 
 static void
@@ -171,22 +498,59 @@ set_startup_time(void)
 	startup_time = time(NULL);
 }
 
+/* Commits go to the WAL, and only reach files.db when checkpointed */
 static time_t
 _get_dbtime(void)
 {
 	char path[PATH_MAX];
 	struct stat st;
+	time_t mtime;
 
 	snprintf(path, sizeof(path), "%s/files.db", db_path);
 	if (stat(path, &st) != 0)
 		return 0;
-	return st.st_mtime;
+	mtime = st.st_mtime;
+	snprintf(path, sizeof(path), "%s/files.db-wal", db_path);
+	if (stat(path, &st) == 0 && st.st_mtime > mtime)
+		mtime = st.st_mtime;
+	return mtime;
+}
+
+/* Copy the WAL into files.db once the writes have stopped for a while, so
+ * that neither the scanner nor the requests being served wait on it.
+ * Returns the seconds until it should be called again, or -1 if there is
+ * nothing to checkpoint. */
+static int
+checkpoint_when_idle(time_t now, int busy)
+{
+	static int checkpointed, changes;
+	static time_t lastwrite;
+	int frames, copied;
+
+	if (sqlite3_total_changes(db) == checkpointed)
+		return -1;
+	if (sqlite3_total_changes(db) != changes)
+	{
+		changes = sqlite3_total_changes(db);
+		lastwrite = now;
+	}
+	if (busy || now < lastwrite + CHECKPOINT_IDLE)
+		return busy ? CHECKPOINT_IDLE : lastwrite + CHECKPOINT_IDLE - now;
+
+	/* Passive, so readers still on an older snapshot hold up only the
+	 * frames they need */
+	if (sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &frames, &copied) == SQLITE_OK)
+		DPRINTF(E_DEBUG, L_DB_SQL, "Checkpointed %d of %d WAL frames\n", copied, frames);
+	checkpointed = changes;
+
+	return -1;
 }
 
 static int
 open_db(sqlite3 **sq3)
 {
 	char path[PATH_MAX];
+	char *mode;
 	int new_db = 0;
 
 	snprintf(path, sizeof(path), "%s/files.db", db_path);
@@ -201,13 +565,40 @@ open_db(sqlite3 **sq3)
 		*sq3 = db;
 	sqlite3_busy_timeout(db, 5000);
 	sql_exec(db, "pragma page_size = 4096");
-	sql_exec(db, "pragma journal_mode = OFF");
-	sql_exec(db, "pragma synchronous = OFF;");
+	/* Readers see the last commit while the scanner writes, and a crash
+	 * loses at most the last few commits instead of corrupting it all */
+	mode = sql_get_text_field(db, "pragma journal_mode = WAL");
+	if (!mode || strcmp(mode, "wal") != 0)
+		DPRINTF(E_WARN, L_GENERAL, "Failed to switch the database to WAL, journal mode is %s\n",
+			mode ? mode : "unknown");
+	sqlite3_free(mode);
+	sql_exec(db, "pragma synchronous = NORMAL;");
+	/* Checkpoints are run when idle, this only bounds the WAL meanwhile */
+	sql_exec(db, "pragma wal_autocheckpoint = %d;", WAL_AUTOCHECKPOINT);
+	sql_exec(db, "pragma journal_size_limit = %d;", WAL_SIZE_LIMIT);
 	sql_exec(db, "pragma default_cache_size = 8192;");
 
 	return new_db;
 }
 
+/* The updateID a database was left at: the one saved at the last scan or
+ * shutdown, or any a container was stamped with since.  Tables an old
+ * version does not have count as 0. */
+static uint32_t
+db_update_id(sqlite3 *db)
+{
+	int64_t saved = 0, stamped = 0;
+
+	if (sql_get_int_field(db, "SELECT count(*) from sqlite_master "
+	                          "where type = 'table' and name = 'SETTINGS'") > 0)
+		saved = sql_get_int_field(db, "SELECT VALUE from SETTINGS where KEY = 'UPDATE_ID'");
+	if (sql_get_int_field(db, "SELECT count(*) from pragma_table_info('OBJECTS') "
+	                          "where name = 'UPDATE_ID'") > 0)
+		stamped = sql_get_int_field(db, "SELECT max(UPDATE_ID) from OBJECTS");
+
+	return MAX(MAX(saved, stamped), 0);
+}
+
 static void
 check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 {
@@ -215,6 +606,11 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 	int ret;
 
 	ret = db_upgrade(db);
+	/* Go on from there even if the database is rebuilt, so no UpdateID
+	 * is ever reused for another listing */
+	updateID = db_update_id(db);
+	if (ret == 0 && UpdateFragments(db) != SQLITE_OK)
+		DPRINTF(E_WARN, L_GENERAL, "Failed to render DIDL-Lite fragments, rendering as served\n");
 	if (ret != 0)
 	{
 		if (ret < 0)
@@ -226,9 +622,11 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 		else
 			DPRINTF(E_WARN, L_GENERAL, "Database version mismatch (%d => %d); need to recreate...\n",
 				ret, DB_VERSION);
+		sql_finalize_cached(db);
 		sqlite3_close(db);
 
-		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm "
+		         "%s/files.catalog %s/art_cache", db_path, db_path, db_path, db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
@@ -239,9 +637,13 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 	if (ret)
 	{
 		SETFLAG(SCANNING_MASK);
+		sql_finalize_cached(db);
 		sqlite3_close(db);
 		open_db(&db);
 		start_scanner();
+		/* which stamped the containers with the next one */
+		updateID++;
+		sql_exec(db, "INSERT or REPLACE into SETTINGS VALUES ('UPDATE_ID', %u)", updateID);
 	}
 }
 
@@ -363,6 +765,15 @@ init(int argc, char **argv)
 	runtime_vars.max_connections = 50;
 	runtime_vars.root_container = NULL;
 	runtime_vars.ifaces[0] = NULL;
+	runtime_vars.stream_workers = 0;
+	runtime_vars.http_workers = 0;
+	runtime_vars.http_backlog = 16;
+	runtime_vars.soap_workers = 2;
+	runtime_vars.prefetch_window = 8 * 1024 * 1024;
+	runtime_vars.prefetch_rate = 32 * 1024 * 1024;
+	runtime_vars.browse_cache_size = 4 * 1024 * 1024;
+	runtime_vars.object_tree = 1;
+	runtime_vars.event_interval = 2;
 
 	media_dir = calloc(1, sizeof(struct media_dir_s));
 	media_dir->path = strdup(realpath("../content", buf));
@@ -395,6 +806,7 @@ init(int argc, char **argv)
 	if (signal(SIGHUP, &sighup) == SIG_ERR)
 		DPRINTF(E_FATAL, L_GENERAL, "Failed to set %s handler. EXITING.\n", "SIGHUP");
 	signal(SIGUSR1, &sigusr1);
+	signal(SIGUSR2, &sigusr2);
 	sa.sa_handler = process_handle_child_termination;
 	if (sigaction(SIGCHLD, &sa, NULL))
 		DPRINTF(E_FATAL, L_GENERAL, "Failed to set %s handler. EXITING.\n", "SIGCHLD");
@@ -432,9 +844,13 @@ main(int argc, char **argv)
 	int ret, i;
 	int shttpl = -1;
 	int smonitor = -1;
-	LIST_HEAD(httplisthead, upnphttp) upnphttphead;
-	struct upnphttp * e = 0;
-	struct upnphttp * next;
+	struct httplisthead upnphttphead;
+	struct http_worker *http_workers = NULL;
+	int inherited[64];	/* HTTP listeners from a hot restart */
+	int ninherited = 0;
+	int handoff_sock = -1;	/* hot restart, from the old instance */
+	int restart_sock = -1;	/* hot restart, to the new instance */
+	int handed_off = 0;
 	fd_set readset;	/* for select() */
 	fd_set writeset;
 	struct timeval timeout, timeofday, lastnotifytime = {0, 0};
@@ -462,11 +878,29 @@ main(int argc, char **argv)
 
 	ret = open_db(NULL);
 	check_db(db, ret, &scanner_pid);
+	search_fts = sql_get_int_field(db, "SELECT count(*) from sqlite_master where name = 'OBJECTS_FTS'") > 0;
+	objtree_load(db);
 	lastdbtime = _get_dbtime();
+	/* The scan and the catalog are accounted for already */
+	last_changecnt = sqlite3_total_changes(db);
+
+	/* start streaming workers before any listening socket exists, so they
+	 * don't hold on to them */
+	streamer_init(runtime_vars.stream_workers);
+
+	handoff_sock = restart_receive(inherited, sizeof(inherited)/sizeof(inherited[0]),
+	                               &ninherited, &sssdp);
+
+	prefetch_init();
+	precompute_init();
+	/* the HTTP workers answer their own requests */
+	if (runtime_vars.http_workers <= 0)
+		soap_workers_init(runtime_vars.soap_workers);
 
 	smonitor = OpenAndConfMonitorSocket();
 
-	sssdp = OpenAndConfSSDPReceiveSocket();
+	if (sssdp < 0)
+		sssdp = OpenAndConfSSDPReceiveSocket();
 	if (sssdp < 0)
 	{
 		DPRINTF(E_INFO, L_GENERAL, "Failed to open socket for receiving SSDP. Trying to use MiniSSDPd\n");
@@ -474,11 +908,24 @@ main(int argc, char **argv)
 		if (SubmitServicesToMiniSSDPD(lan_addr[0].str, runtime_vars.port) < 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to connect to MiniSSDPd. EXITING");
 	}
-	/* open socket for HTTP connections. */
-	shttpl = OpenAndConfHTTPSocket(runtime_vars.port);
-	if (shttpl < 0)
-		DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
-	DPRINTF(E_WARN, L_GENERAL, "HTTP listening on port %d\n", runtime_vars.port);
+	/* open socket for HTTP connections, or leave them to the workers. */
+	if (runtime_vars.http_workers > 0)
+	{
+		http_workers = start_http_workers(runtime_vars.http_workers, inherited, ninherited);
+		for (i = runtime_vars.http_workers; i < ninherited; i++)
+			close(inherited[i]);
+		DPRINTF(E_WARN, L_GENERAL, "HTTP listening on port %d with %d workers\n",
+			runtime_vars.port, runtime_vars.http_workers);
+	}
+	else
+	{
+		shttpl = ninherited ? inherited[0] : OpenAndConfHTTPSocket(runtime_vars.port, 0);
+		for (i = 1; i < ninherited; i++)
+			close(inherited[i]);
+		if (shttpl < 0)
+			DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
+		DPRINTF(E_WARN, L_GENERAL, "HTTP listening on port %d\n", runtime_vars.port);
+	}
 
 	reload_ifaces(0);
 	lastnotifytime.tv_sec = time(NULL) + runtime_vars.notify_interval;
@@ -524,18 +971,54 @@ main(int argc, char **argv)
 			}
 		}
 
+		streamer_maintain();
+
+		/* the main thread's own connections are the only ones we can
+		 * tell are busy */
+		ret = checkpoint_when_idle(timeofday.tv_sec, upnphttphead.lh_first != NULL);
+		if (ret >= 0 && ret < timeout.tv_sec)
+		{
+			timeout.tv_sec = ret;
+			timeout.tv_usec = 0;
+		}
+
+		if (restart_requested)
+		{
+			restart_requested = 0;
+			if (restart_sock < 0)
+				restart_sock = restart_exec(argv);
+		}
+
+		if (clear_cache_requested)
+		{
+			struct browse_cache_stats stats;
+
+			clear_cache_requested = 0;
+			browse_cache_get_stats(&stats);
+			DPRINTF(E_WARN, L_GENERAL, "Browse cache: %lu hits, %lu coalesced, %lu misses, "
+			        "%lu evictions, %zu entries in %zu bytes\n", stats.hits,
+			        stats.coalesced, stats.misses, stats.evictions,
+			        stats.entries, stats.bytes);
+			browse_cache_clear();
+		}
+
 		if (GETFLAG(SCANNING_MASK))
 		{
 			if (!scanner_pid || kill(scanner_pid, 0) != 0)
 			{
 				CLEARFLAG(SCANNING_MASK);
 				if (_get_dbtime() != lastdbtime)
+				{
+					objtree_refresh(db, 1);
 					updateID++;
+					upnp_event_var_change_notify(EContentDirectory);
+				}
 			}
 		}
 
 		/* select open sockets (SSDP, HTTP listen, and all HTTP soap sockets) */
 		FD_ZERO(&readset);
+		FD_ZERO(&writeset);
 
 		if (sssdp >= 0) 
 		{
@@ -553,18 +1036,33 @@ main(int argc, char **argv)
 			FD_SET(smonitor, &readset);
 			max_fd = MAX(max_fd, smonitor);
 		}
+		if (handoff_sock >= 0)
+		{
+			FD_SET(handoff_sock, &readset);
+			max_fd = MAX(max_fd, handoff_sock);
+		}
+		if (restart_sock >= 0)
+		{
+			FD_SET(restart_sock, &readset);
+			max_fd = MAX(max_fd, restart_sock);
+		}
+		if (soap_workers_fd() >= 0)
+		{
+			FD_SET(soap_workers_fd(), &readset);
+			max_fd = MAX(max_fd, soap_workers_fd());
+		}
 
-		i = 0;	/* active HTTP connections count */
-		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
+		/* active HTTP connections count; with workers we can't tell */
+		i = http_fdset(&upnphttphead, &readset, &max_fd) + runtime_vars.http_workers;
+
+		/* event subscribers, and the NOTIFYs on their way to them */
+		ret = upnpevents_selectfds(&readset, &writeset, &max_fd, timeofday.tv_sec);
+		if (ret >= 0 && ret < timeout.tv_sec)
 		{
-			if ((e->socket >= 0) && (e->state <= 2))
-			{
-				FD_SET(e->socket, &readset);
-				max_fd = MAX(max_fd, e->socket);
-				i++;
-			}
+			timeout.tv_sec = ret;
+			timeout.tv_usec = 0;
 		}
-		FD_ZERO(&writeset);
+		i += upnpevents_subscribers();
 
 		ret = select(max_fd+1, &readset, &writeset, 0, &timeout);
 		if (ret < 0)
@@ -584,8 +1082,39 @@ main(int argc, char **argv)
 		{
 			ProcessMonitorEvent(smonitor);
 		}
+		upnpevents_processfds(&readset, &writeset, time(NULL));
+		/* send what the SOAP workers have answered */
+		if (soap_workers_fd() >= 0 && FD_ISSET(soap_workers_fd(), &readset))
+		{
+			soap_workers_complete();
+		}
+		if (handoff_sock >= 0 && FD_ISSET(handoff_sock, &readset))
+		{
+			if (restart_process(handoff_sock) != 0)
+			{
+				close(handoff_sock);
+				handoff_sock = -1;
+			}
+		}
+		if (restart_sock >= 0 && FD_ISSET(restart_sock, &readset))
+		{
+			char ready;
+
+			/* the new instance says it is up, or died trying */
+			if (recv(restart_sock, &ready, 1, 0) == 1)
+			{
+				restart_handoff(restart_sock, &upnphttphead, &shttpl, http_workers, &sssdp);
+				http_workers = NULL;
+				handed_off = 1;
+				goto shutdown;
+			}
+			DPRINTF(E_ERROR, L_GENERAL, "Hot restart failed, carrying on\n");
+			close(restart_sock);
+			restart_sock = -1;
+		}
 		/* increment SystemUpdateID if the content database has changed,
-		 * and if there is an active HTTP connection, at most once every 2 seconds */
+		 * and if there is an active HTTP connection or an event subscriber,
+		 * at most once every 2 seconds */
 		if (i && (timeofday.tv_sec >= (lastupdatetime + 2)))
 		{
 			if (GETFLAG(SCANNING_MASK))
@@ -599,63 +1128,17 @@ main(int argc, char **argv)
 			}
 			if (sqlite3_total_changes(db) != last_changecnt)
 			{
+				/* Browse must not list what it did before under the
+				 * new updateID */
+				objtree_refresh(db, last_changecnt < 0);
 				updateID++;
+				upnp_event_var_change_notify(EContentDirectory);
 				last_changecnt = sqlite3_total_changes(db);
 				lastupdatetime = timeofday.tv_sec;
 			}
 		}
 		/* process active HTTP connections */
-		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
-		{
-			if ((e->socket >= 0) && (e->state <= 2) && (FD_ISSET(e->socket, &readset)))
-				Process_upnphttp(e);
-		}
-		/* process incoming HTTP connections */
-		if (shttpl >= 0 && FD_ISSET(shttpl, &readset))
-		{
-			int shttp;
-			socklen_t clientnamelen;
-			struct sockaddr_in clientname;
-			clientnamelen = sizeof(struct sockaddr_in);
-			shttp = accept(shttpl, (struct sockaddr *)&clientname, &clientnamelen);
-			if (shttp<0)
-			{
-				DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
-			}
-			else
-			{
-				struct upnphttp * tmp = 0;
-				DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
-					inet_ntoa(clientname.sin_addr),
-					ntohs(clientname.sin_port) );
-				/*if (fcntl(shttp, F_SETFL, O_NONBLOCK) < 0) {
-					DPRINTF(E_ERROR, L_GENERAL, "fcntl F_SETFL, O_NONBLOCK\n");
-				}*/
-				/* Create a new upnphttp object and add it to
-				 * the active upnphttp object list */
-				tmp = New_upnphttp(shttp);
-				if (tmp)
-				{
-					tmp->clientaddr = clientname.sin_addr;
-					LIST_INSERT_HEAD(&upnphttphead, tmp, entries);
-				}
-				else
-				{
-					DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
-					close(shttp);
-				}
-			}
-		}
-		/* delete finished HTTP connections */
-		for (e = upnphttphead.lh_first; e != NULL; e = next)
-		{
-			next = e->entries.le_next;
-			if(e->state >= 100)
-			{
-				LIST_REMOVE(e, entries);
-				Delete_upnphttp(e);
-			}
-		}
+		http_process(&upnphttphead, &readset, shttpl);
 	}
 
 shutdown:
@@ -663,23 +1146,29 @@ shutdown:
 	if (GETFLAG(SCANNING_MASK) && scanner_pid)
 		kill(scanner_pid, SIGKILL);
 
-	/* close out open sockets */
-	while (upnphttphead.lh_first != NULL)
-	{
-		e = upnphttphead.lh_first;
-		LIST_REMOVE(e, entries);
-		Delete_upnphttp(e);
-	}
+	/* close out open sockets, once no worker is using them */
+	soap_workers_shutdown();
+	upnpevents_removeSubscribers();
+	http_close_all(&upnphttphead);
+	if (http_workers)
+		stop_http_workers(http_workers, runtime_vars.http_workers, 0);
 	if (sssdp >= 0)
 		close(sssdp);
 	if (shttpl >= 0)
 		close(shttpl);
 	if (smonitor >= 0)
 		close(smonitor);
+	if (handoff_sock >= 0)
+		close(handoff_sock);
+	if (restart_sock >= 0)
+		close(restart_sock);
 	
 	for (i = 0; i < n_lan_addr; i++)
 	{
-		SendSSDPGoodbyes(lan_addr[i].snotify);
+		/* after a hot restart the new instance carries on, so the
+		 * renderers must not hear us leave */
+		if (!handed_off)
+			SendSSDPGoodbyes(lan_addr[i].snotify);
 		close(lan_addr[i].snotify);
 	}
 
@@ -688,14 +1177,26 @@ shutdown:
 		pthread_kill(inotify_thread, SIGCHLD);
 		pthread_join(inotify_thread, NULL);
 	}
+	prefetch_shutdown();
+	precompute_shutdown();
+	objtree_shutdown();
 
-	/* kill other child processes */
-	process_reap_children();
+	/* kill other child processes; after a hot restart they finish the
+	 * transfers they have, and the database is the new instance's */
+	if (!handed_off)
+	{
+		sql_exec(db, "INSERT or REPLACE into SETTINGS VALUES ('UPDATE_ID', %u)", updateID);
+		streamer_shutdown();
+		process_reap_children();
+	}
 	free(children);
 
+	/* the last connection to close checkpoints and removes the WAL */
+	sql_reader_close_all();
+	sql_finalize_cached(db);
 	sqlite3_close(db);
 
-	if (pidfilename && unlink(pidfilename) < 0)
+	if (!handed_off && pidfilename && unlink(pidfilename) < 0)
 		DPRINTF(E_ERROR, L_GENERAL, "Failed to remove pidfile %s: %s\n", pidfilename, strerror(errno));
 
 	log_close();
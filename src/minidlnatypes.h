@@ -51,6 +51,15 @@ struct runtime_vars_s {
 	int max_connections;	/* max number of simultaneous conenctions */
 	const char *root_container;	/* root ObjectID (instead of "0") */
 	const char *ifaces[MAX_LAN_ADDR];	/* list of configured network interfaces */
+	int http_workers;	/* HTTP worker threads with their own listener, 0 for none */
+	int http_backlog;	/* listen() backlog of each HTTP socket */
+	int soap_workers;	/* threads answering SOAP requests for the main loop, 0 for none */
+	int stream_workers;	/* pre-forked streaming workers, 0 to fork per request */
+	int prefetch_window;	/* bytes to prefetch from the start of a file, 0 to disable */
+	int prefetch_rate;	/* bytes per second the prefetcher may read */
+	int browse_cache_size;	/* bytes of Browse responses to keep, 0 to disable */
+	int object_tree;	/* keep a copy of the objects in memory for Browse, 0 to disable */
+	int event_interval;	/* seconds between the events of a service, at least */
 };
 
 struct string_s {
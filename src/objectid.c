@@ -0,0 +1,148 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "objectid.h"
+#include "sql.h"
+
+static int64_t
+lookup(sqlite3_stmt *stmt, int64_t parent, int64_t idx)
+{
+	int64_t key = -1;
+
+	sqlite3_bind_int64(stmt, 1, parent);
+	sqlite3_bind_int64(stmt, 2, idx);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		key = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return key;
+}
+
+/* Walk down from the root one component at a time, each step being a
+ * lookup in the (PARENT, IDX) index. */
+int64_t
+object_key(sqlite3 *db, const char *object_id, char *canon, size_t len)
+{
+	sqlite3_stmt *stmt;
+	char id[OBJECT_ID_LEN] = "0";
+	char parent[OBJECT_ID_LEN];
+	const char *p = object_id;
+	char *end;
+	int64_t key, idx;
+
+	if (!object_id)
+		return -1;
+	stmt = sql_prepare_cached(db, "SELECT ID from OBJECTS where PARENT = ? and IDX = ?");
+	if (!stmt)
+		return -1;
+
+	key = lookup(stmt, 0, 0);
+	/* "0" is the root, any other first component a child of it */
+	if (strcmp(object_id, "0") != 0)
+	{
+		while (key > 0)
+		{
+			if (!isxdigit((unsigned char)*p))
+			{
+				key = -1;
+				break;
+			}
+			errno = 0;
+			idx = strtoll(p, &end, 16);
+			if (errno || (*end && *end != '$'))
+			{
+				key = -1;
+				break;
+			}
+			key = lookup(stmt, key, idx);
+			strcpy(parent, id);
+			object_id_child(id, sizeof(id), parent, idx);
+			if (!*end)
+				break;
+			p = end + 1;
+		}
+	}
+
+	if (key > 0 && canon)
+		snprintf(canon, len, "%s", id);
+
+	return key;
+}
+
+int
+object_id_from_key(sqlite3 *db, int64_t key, char *buf, size_t len)
+{
+	sqlite3_stmt *stmt;
+	/* each component takes at least two characters */
+	int64_t path[OBJECT_ID_LEN / 2];
+	char parent[OBJECT_ID_LEN];
+	int depth = 0;
+
+	stmt = sql_prepare_cached(db, "SELECT PARENT, IDX from OBJECTS where ID = ?");
+	if (!stmt)
+		return -1;
+	while (key > 0 && depth < OBJECT_ID_LEN / 2)
+	{
+		sqlite3_bind_int64(stmt, 1, key);
+		if (sqlite3_step(stmt) != SQLITE_ROW)
+			break;
+		key = sqlite3_column_int64(stmt, 0);
+		path[depth++] = sqlite3_column_int64(stmt, 1);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_reset(stmt);
+	if (key != 0 || !depth)
+		return -1;
+
+	snprintf(buf, len, "-1");
+	while (depth--)
+	{
+		snprintf(parent, sizeof(parent), "%s", buf);
+		object_id_child(buf, len, parent, path[depth]);
+	}
+
+	return 0;
+}
+
+void
+object_id_child(char *buf, size_t len, const char *parent, int64_t idx)
+{
+	if (strcmp(parent, "-1") == 0 || strcmp(parent, "0") == 0)
+		snprintf(buf, len, "%llX", (long long)idx);
+	else
+		snprintf(buf, len, "%s$%llX", parent, (long long)idx);
+}
+
+void
+object_id_parent(char *buf, size_t len, const char *object_id)
+{
+	const char *sep = strrchr(object_id, '$');
+
+	if (sep)
+		snprintf(buf, len, "%.*s", (int)(sep - object_id), object_id);
+	else if (strcmp(object_id, "0") == 0)
+		snprintf(buf, len, "-1");
+	else
+		snprintf(buf, len, "0");
+}
@@ -0,0 +1,68 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __OBJECTID_H__
+#define __OBJECTID_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sqlite3.h>
+
+/* Rows of OBJECTS are keyed by integers: PARENT is the ID of the parent
+ * row, 0 for the root container, and IDX the position of the object in its
+ * parent.  The ObjectIDs clients see are the IDX path down from the root in
+ * hex, like "64$1$A".  The root itself is "0", and its parent "-1". */
+
+#define OBJECT_ID_LEN	256
+
+/**
+ * Find the row of an ObjectID.
+ * @param db The database connection.
+ * @param object_id The ObjectID, as sent by a client.
+ * @param canon If not NULL, filled with the ObjectID as we would write it.
+ * @param len The size of canon.
+ * @return The ID of the row, -1 if there is no such object.
+ */
+int64_t object_key(sqlite3 *db, const char *object_id, char *canon, size_t len);
+
+/**
+ * Build the ObjectID of a row, walking up to the root.
+ * @param db The database connection.
+ * @param key The ID of the row.
+ * @param buf Filled with the ObjectID.
+ * @param len The size of buf.
+ * @return 0 on success, -1 if there is no such row.
+ */
+int object_id_from_key(sqlite3 *db, int64_t key, char *buf, size_t len);
+
+/**
+ * Build the ObjectID of a child.
+ * @param buf Filled with the ObjectID.
+ * @param len The size of buf.
+ * @param parent The ObjectID of the parent, "-1" for the root itself.
+ * @param idx The IDX of the child.
+ */
+void object_id_child(char *buf, size_t len, const char *parent, int64_t idx);
+
+/**
+ * Build the ObjectID of the parent of an object.
+ * @param buf Filled with the ObjectID of the parent.
+ * @param len The size of buf.
+ * @param object_id A canonical ObjectID.
+ */
+void object_id_parent(char *buf, size_t len, const char *object_id);
+
+#endif // __OBJECTID_H__
@@ -0,0 +1,720 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "upnpglobalvars.h"
+#include "objtree.h"
+#include "objectid.h"
+#include "sql.h"
+#include "log.h"
+
+/* Few enough that looking them up one after the other is quick */
+#define MAX_INTERNED	1024
+
+/* The catalog is the tree as it is laid out in memory, written next to the
+ * database so that the next start maps it instead of building it again.
+ * Pages are read in as they are used, so it is ready at once whatever the
+ * size of the library.  It is only ever replaced whole, by rename(), and
+ * is on disk before the database records it.
+ *
+ * Only the header is checked when it is mapped; what the nodes point at is
+ * checked as it is used, so one left corrupt all the same serves nothing
+ * wrong rather than reading outside of it. */
+#define CATALOG_FILE	"files.catalog"
+#define CATALOG_MAGIC	"MDLNACAT"
+#define CATALOG_VERSION	2
+
+struct catalog_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;	/* sizeof(struct objtree_node), which also
+				 * tells the ABI apart */
+	int64_t generation;	/* the same as CATALOG in SETTINGS */
+	int64_t max_key;
+	uint32_t count;
+	uint32_t root;
+	uint32_t ninterned;
+	uint32_t pad;
+	uint64_t nodes_off;
+	uint64_t by_key_off;
+	uint64_t interned_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+	uint64_t size;		/* of the whole file */
+};
+
+struct objtree
+{
+	struct objtree_node *nodes;
+	uint32_t count;
+	uint32_t root;
+	/* index + 1 of the object with each ID, 0 for none */
+	uint32_t *by_key;
+	int64_t max_key;
+	char *strings;		/* NUL terminated, one after the other */
+	size_t strings_len;
+	uint32_t *interned;	/* offsets of the interned strings */
+	uint32_t ninterned;
+	void *map;		/* the catalog, if mapped from it */
+	size_t map_len;
+	int changes;		/* sqlite3_total_changes() when built */
+	int refs;
+};
+
+static struct objtree *current = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+tree_free(struct objtree *tree)
+{
+	if (tree->map)
+		munmap(tree->map, tree->map_len);
+	else
+	{
+		free(tree->nodes);
+		free(tree->by_key);
+		free(tree->strings);
+		free(tree->interned);
+	}
+	free(tree);
+}
+
+/* Copy a string into the block, returning its offset, 0 for NULL and
+ * UINT32_MAX when out of memory.  Offset 0 is never a string. */
+static uint32_t
+add_string(struct objtree *tree, size_t *size, const char *text)
+{
+	size_t len, off;
+	char *strings;
+
+	if (!text)
+		return 0;
+	len = strlen(text) + 1;
+	if (tree->strings_len + len >= UINT32_MAX)
+		return UINT32_MAX;
+	if (tree->strings_len + len > *size)
+	{
+		while (tree->strings_len + len > *size)
+			*size *= 2;
+		strings = realloc(tree->strings, *size);
+		if (!strings)
+			return UINT32_MAX;
+		tree->strings = strings;
+	}
+	off = tree->strings_len;
+	memcpy(tree->strings + off, text, len);
+	tree->strings_len += len;
+
+	return off;
+}
+
+/* The index of a class or MIME type, 0 for NULL and UINT16_MAX on error */
+static uint16_t
+intern(struct objtree *tree, size_t *size, const char *text)
+{
+	uint32_t i, off;
+
+	if (!text)
+		return 0;
+	for (i = 1; i < tree->ninterned; i++)
+	{
+		if (strcmp(tree->strings + tree->interned[i], text) == 0)
+			return i;
+	}
+	if (tree->ninterned >= MAX_INTERNED)
+		return UINT16_MAX;
+	off = add_string(tree, size, text);
+	if (off == UINT32_MAX)
+		return UINT16_MAX;
+	tree->interned[i] = off;
+	tree->ninterned++;
+
+	return i;
+}
+
+static inline int64_t
+column_int(sqlite3_stmt *stmt, int col)
+{
+	return sqlite3_column_type(stmt, col) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, col);
+}
+
+/* Point each object at its parent, and each container at the run of its
+ * children, which the (PARENT, IDX) order put next to each other */
+static void
+link_nodes(struct objtree *tree, const int64_t *parents)
+{
+	const struct objtree_node *parent;
+	uint32_t i, p;
+
+	tree->root = OBJTREE_NONE;
+	for (i = 0; i < tree->count; i++)
+	{
+		if (parents[i] == 0)
+		{
+			tree->nodes[i].parent = OBJTREE_NONE;
+			if (tree->nodes[i].idx == 0)
+				tree->root = i;
+			continue;
+		}
+		parent = objtree_lookup(tree, parents[i]);
+		if (!parent)
+		{
+			tree->nodes[i].parent = OBJTREE_NONE;
+			continue;
+		}
+		p = parent - tree->nodes;
+		tree->nodes[i].parent = p;
+		if (!tree->nodes[p].children++)
+			tree->nodes[p].first_child = i;
+	}
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len)
+	{
+		n = write(fd, p, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static inline uint64_t
+align8(uint64_t off)
+{
+	return (off + 7) & ~(uint64_t)7;
+}
+
+/* Lay the header out for a tree, leaving the generation to the caller */
+static void
+catalog_layout(const struct objtree *tree, struct catalog_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic));
+	hdr->version = CATALOG_VERSION;
+	hdr->node_size = sizeof(struct objtree_node);
+	hdr->max_key = tree->max_key;
+	hdr->count = tree->count;
+	hdr->root = tree->root;
+	hdr->ninterned = tree->ninterned;
+	hdr->nodes_off = align8(sizeof(*hdr));
+	hdr->by_key_off = align8(hdr->nodes_off + (uint64_t)tree->count * sizeof(*tree->nodes));
+	hdr->interned_off = align8(hdr->by_key_off + (uint64_t)(tree->max_key + 1) * sizeof(*tree->by_key));
+	hdr->strings_off = align8(hdr->interned_off + (uint64_t)tree->ninterned * sizeof(*tree->interned));
+	hdr->strings_len = tree->strings_len;
+	hdr->size = hdr->strings_off + tree->strings_len;
+}
+
+/* Write the catalog of a tree, then record in the database which one
+ * goes with it.  Until then, the one there before no longer matches. */
+static int
+catalog_write(const struct objtree *tree, sqlite3 *db)
+{
+	static const char zeros[8];
+	struct catalog_header hdr;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct {
+		const void *data;
+		uint64_t off, len;
+	} parts[5];
+	uint64_t off = 0;
+	int fd, i, ret = 0;
+
+	catalog_layout(tree, &hdr);
+	sqlite3_randomness(sizeof(hdr.generation), &hdr.generation);
+	hdr.generation &= INT64_MAX;
+	parts[0].data = &hdr;
+	parts[0].off = 0;
+	parts[0].len = sizeof(hdr);
+	parts[1].data = tree->nodes;
+	parts[1].off = hdr.nodes_off;
+	parts[1].len = (uint64_t)tree->count * sizeof(*tree->nodes);
+	parts[2].data = tree->by_key;
+	parts[2].off = hdr.by_key_off;
+	parts[2].len = (uint64_t)(tree->max_key + 1) * sizeof(*tree->by_key);
+	parts[3].data = tree->interned;
+	parts[3].off = hdr.interned_off;
+	parts[3].len = (uint64_t)tree->ninterned * sizeof(*tree->interned);
+	parts[4].data = tree->strings;
+	parts[4].off = hdr.strings_off;
+	parts[4].len = tree->strings_len;
+
+	snprintf(path, sizeof(path), "%s/" CATALOG_FILE, db_path);
+	snprintf(tmp, sizeof(tmp), "%s/" CATALOG_FILE ".new", db_path);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Failed to write %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < 5 && ret == 0; i++)
+	{
+		/* pad up to where the part goes */
+		ret = write_all(fd, zeros, parts[i].off - off);
+		if (ret == 0)
+			ret = write_all(fd, parts[i].data, parts[i].len);
+		off = parts[i].off + parts[i].len;
+	}
+	if (ret == 0)
+		ret = fsync(fd);
+	if (close(fd) != 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp, path) != 0)
+		ret = -1;
+	if (ret != 0)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Failed to write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	/* and the rename, before the generation can outlast a crash */
+	fd = open(db_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0 || fsync(fd) != 0)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Failed to sync %s: %s\n", db_path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return sql_exec(db, "INSERT or REPLACE into SETTINGS VALUES ('CATALOG', %lld)",
+	                (long long)hdr.generation) == SQLITE_OK ? 0 : -1;
+}
+
+/* Map the catalog, if it is the one that goes with the database */
+static struct objtree *
+catalog_map(sqlite3 *db)
+{
+	const struct catalog_header *hdr;
+	struct catalog_header want;
+	struct objtree *tree;
+	char path[PATH_MAX];
+	struct stat st;
+	int64_t generation;
+	void *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/" CATALOG_FILE, db_path);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(*hdr))
+	{
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	tree = calloc(1, sizeof(*tree));
+	if (!tree)
+		goto invalid;
+
+	/* Only the header is checked, reading the rest would take it all in */
+	hdr = map;
+	generation = sql_get_int_cached(db, "SELECT VALUE from SETTINGS where KEY = 'CATALOG'", "");
+	if (memcmp(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != CATALOG_VERSION || hdr->node_size != sizeof(struct objtree_node) ||
+	    generation <= 0 || hdr->generation != generation ||
+	    hdr->max_key != sql_get_int_cached(db, "SELECT max(ID) from OBJECTS", "") ||
+	    hdr->ninterned > MAX_INTERNED || !hdr->strings_len || hdr->strings_len >= UINT32_MAX ||
+	    (hdr->root >= hdr->count && hdr->root != OBJTREE_NONE))
+		goto invalid;
+	tree->count = hdr->count;
+	tree->root = hdr->root;
+	tree->max_key = hdr->max_key;
+	tree->ninterned = hdr->ninterned;
+	tree->strings_len = hdr->strings_len;
+	/* which also keeps every part inside the file */
+	catalog_layout(tree, &want);
+	if (hdr->nodes_off != want.nodes_off || hdr->by_key_off != want.by_key_off ||
+	    hdr->interned_off != want.interned_off || hdr->strings_off != want.strings_off ||
+	    hdr->size != want.size || want.size != st.st_size)
+		goto invalid;
+
+	tree->map = map;
+	tree->map_len = st.st_size;
+	tree->nodes = (struct objtree_node *)((char *)map + hdr->nodes_off);
+	tree->by_key = (uint32_t *)((char *)map + hdr->by_key_off);
+	tree->interned = (uint32_t *)((char *)map + hdr->interned_off);
+	tree->strings = (char *)map + hdr->strings_off;
+	tree->refs = 1;
+	/* so that every string in it ends */
+	if (tree->strings[tree->strings_len - 1] != '\0')
+		goto invalid;
+
+	return tree;
+
+invalid:
+	free(tree);
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+/* Make a tree the current one */
+static void
+publish(struct objtree *tree, sqlite3 *db)
+{
+	struct objtree *old;
+
+	tree->changes = sqlite3_total_changes(db);
+	pthread_mutex_lock(&lock);
+	old = current;
+	current = tree;
+	pthread_mutex_unlock(&lock);
+	objtree_put(old);
+}
+
+int
+objtree_build(sqlite3 *db)
+{
+	struct objtree *tree;
+	struct objtree_node *node;
+	sqlite3_stmt *stmt;
+	int64_t *parents = NULL;
+	const char *text;
+	size_t cap = 0, strings_size = 65536;
+	uint32_t i;
+	int ret;
+
+	if (!runtime_vars.object_tree)
+		return 0;
+	tree = calloc(1, sizeof(*tree));
+	if (!tree)
+		return -1;
+	tree->strings = malloc(strings_size);
+	tree->interned = calloc(MAX_INTERNED, sizeof(*tree->interned));
+	if (!tree->strings || !tree->interned)
+	{
+		tree_free(tree);
+		return -1;
+	}
+	/* neither offset nor index 0 is ever used */
+	tree->strings[0] = '\0';
+	tree->strings_len = 1;
+	tree->ninterned = 1;
+	tree->refs = 1;
+
+	ret = sqlite3_prepare_v2(db, "SELECT ID, PARENT, IDX, CLASS, SIZE, TITLE, MIME, "
+	                             "CHILD_COUNT, STORAGE_USED, DIDL, PATH, UPDATE_ID "
+	                             "from OBJECTS order by PARENT, IDX", -1, &stmt, NULL);
+	if (ret != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "Object tree: %s\n", sqlite3_errmsg(db));
+		tree_free(tree);
+		return -1;
+	}
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if (tree->count == cap)
+		{
+			size_t n = cap ? cap * 2 : 4096;
+			void *nodes, *p;
+
+			if (n >= OBJTREE_NONE)
+				break;
+			nodes = realloc(tree->nodes, n * sizeof(*tree->nodes));
+			if (nodes)
+				tree->nodes = nodes;
+			p = realloc(parents, n * sizeof(*parents));
+			if (p)
+				parents = p;
+			if (!nodes || !p)
+				break;
+			cap = n;
+		}
+		node = &tree->nodes[tree->count];
+		memset(node, 0, sizeof(*node));
+		node->key = sqlite3_column_int64(stmt, 0);
+		parents[tree->count] = sqlite3_column_int64(stmt, 1);
+		node->idx = sqlite3_column_int64(stmt, 2);
+		text = (const char *)sqlite3_column_text(stmt, 3);
+		node->class = intern(tree, &strings_size, text ? text : "");
+		node->size = column_int(stmt, 4);
+		node->title = add_string(tree, &strings_size, (const char *)sqlite3_column_text(stmt, 5));
+		node->mime = intern(tree, &strings_size, (const char *)sqlite3_column_text(stmt, 6));
+		node->child_count = column_int(stmt, 7);
+		node->storage_used = column_int(stmt, 8);
+		node->didl = add_string(tree, &strings_size, (const char *)sqlite3_column_text(stmt, 9));
+		node->path = add_string(tree, &strings_size, (const char *)sqlite3_column_text(stmt, 10));
+		node->update_id = sqlite3_column_int64(stmt, 11);
+		if (node->key <= 0 || node->class == UINT16_MAX || node->mime == UINT16_MAX ||
+		    node->title == UINT32_MAX || node->didl == UINT32_MAX || node->path == UINT32_MAX)
+			break;
+		if (node->key > tree->max_key)
+			tree->max_key = node->key;
+		tree->count++;
+	}
+	sqlite3_finalize(stmt);
+	if (ret != SQLITE_DONE)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "Failed to build the object tree: %s\n",
+		        ret == SQLITE_ROW ? "out of memory" : sqlite3_errmsg(db));
+		free(parents);
+		tree_free(tree);
+		return -1;
+	}
+
+	tree->by_key = calloc(tree->max_key + 1, sizeof(*tree->by_key));
+	if (!tree->by_key)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "Failed to build the object tree: out of memory\n");
+		free(parents);
+		tree_free(tree);
+		return -1;
+	}
+	for (i = 0; i < tree->count; i++)
+		tree->by_key[tree->nodes[i].key] = i + 1;
+	link_nodes(tree, parents);
+	free(parents);
+
+	DPRINTF(E_WARN, L_DB_SQL, "Object tree: %u objects in %zu KiB\n", tree->count,
+	        (tree->count * sizeof(*tree->nodes) + (tree->max_key + 1) * sizeof(*tree->by_key) +
+	         tree->strings_len) / 1024);
+	/* Without it the next start builds the tree again */
+	catalog_write(tree, db);
+	publish(tree, db);
+
+	return 0;
+}
+
+int
+objtree_load(sqlite3 *db)
+{
+	struct objtree *tree;
+
+	if (!runtime_vars.object_tree)
+		return 0;
+	tree = catalog_map(db);
+	if (!tree)
+		return objtree_build(db);
+	DPRINTF(E_WARN, L_DB_SQL, "Object tree: %u objects mapped from " CATALOG_FILE "\n", tree->count);
+	publish(tree, db);
+
+	return 0;
+}
+
+void
+objtree_refresh(sqlite3 *db, int force)
+{
+	int changes;
+
+	pthread_mutex_lock(&lock);
+	changes = current ? current->changes : -1;
+	pthread_mutex_unlock(&lock);
+	if (changes < 0 || force || changes != sqlite3_total_changes(db))
+	{
+		/* Without a tree that is up to date, Browse has to go to SQL */
+		if (objtree_build(db) != 0)
+			objtree_shutdown();
+	}
+}
+
+struct objtree *
+objtree_get(void)
+{
+	struct objtree *tree;
+
+	pthread_mutex_lock(&lock);
+	tree = current;
+	if (tree)
+		tree->refs++;
+	pthread_mutex_unlock(&lock);
+
+	return tree;
+}
+
+void
+objtree_put(struct objtree *tree)
+{
+	int refs;
+
+	if (!tree)
+		return;
+	pthread_mutex_lock(&lock);
+	refs = --tree->refs;
+	pthread_mutex_unlock(&lock);
+	if (!refs)
+		tree_free(tree);
+}
+
+void
+objtree_shutdown(void)
+{
+	struct objtree *old;
+
+	pthread_mutex_lock(&lock);
+	old = current;
+	current = NULL;
+	pthread_mutex_unlock(&lock);
+	objtree_put(old);
+}
+
+/* Whether the run of children a node points at is in the tree */
+static inline int
+children_valid(const struct objtree *tree, const struct objtree_node *node)
+{
+	return node->first_child <= tree->count && node->children <= tree->count - node->first_child;
+}
+
+/* The child of a container at IDX idx, by bisection */
+static const struct objtree_node *
+find_child(const struct objtree *tree, const struct objtree_node *node, int64_t idx)
+{
+	const struct objtree_node *children = tree->nodes + node->first_child;
+	uint32_t lo = 0, hi = node->children, mid;
+
+	if (!children_valid(tree, node))
+		return NULL;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (children[mid].idx < idx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo < node->children && children[lo].idx == idx) ? &children[lo] : NULL;
+}
+
+const struct objtree_node *
+objtree_find(const struct objtree *tree, const char *object_id, char *canon, size_t len)
+{
+	const struct objtree_node *node;
+	char id[OBJECT_ID_LEN] = "0";
+	char parent[OBJECT_ID_LEN];
+	const char *p = object_id;
+	char *end;
+	int64_t idx;
+
+	if (!object_id || tree->root == OBJTREE_NONE)
+		return NULL;
+	node = &tree->nodes[tree->root];
+	/* "0" is the root, any other first component a child of it */
+	if (strcmp(object_id, "0") != 0)
+	{
+		while (node)
+		{
+			if (!isxdigit((unsigned char)*p))
+				return NULL;
+			errno = 0;
+			idx = strtoll(p, &end, 16);
+			if (errno || (*end && *end != '$'))
+				return NULL;
+			node = find_child(tree, node, idx);
+			if (canon)
+			{
+				strcpy(parent, id);
+				object_id_child(id, sizeof(id), parent, idx);
+			}
+			if (!*end)
+				break;
+			p = end + 1;
+		}
+	}
+
+	if (node && canon)
+		snprintf(canon, len, "%s", id);
+
+	return node;
+}
+
+const struct objtree_node *
+objtree_lookup(const struct objtree *tree, int64_t key)
+{
+	if (key <= 0 || key > tree->max_key || !tree->by_key[key] || tree->by_key[key] > tree->count)
+		return NULL;
+
+	return &tree->nodes[tree->by_key[key] - 1];
+}
+
+const struct objtree_node *
+objtree_children(const struct objtree *tree, const struct objtree_node *node, int *count)
+{
+	*count = children_valid(tree, node) ? node->children : 0;
+
+	return tree->nodes + node->first_child;
+}
+
+const struct objtree_node *
+objtree_parent(const struct objtree *tree, const struct objtree_node *node)
+{
+	return node->parent >= tree->count ? NULL : &tree->nodes[node->parent];
+}
+
+static inline const char *
+string_at(const struct objtree *tree, uint32_t off)
+{
+	return (off && off < tree->strings_len) ? tree->strings + off : NULL;
+}
+
+static inline const char *
+interned_at(const struct objtree *tree, uint16_t i)
+{
+	return i < tree->ninterned ? string_at(tree, tree->interned[i]) : NULL;
+}
+
+void
+objtree_object(const struct objtree *tree, const struct objtree_node *node,
+               struct didl_object *obj)
+{
+	obj->key = node->key;
+	/* every object has one */
+	obj->class = interned_at(tree, node->class);
+	if (!obj->class)
+		obj->class = "";
+	obj->title = string_at(tree, node->title);
+	obj->mime = interned_at(tree, node->mime);
+	obj->size = node->size;
+	obj->child_count = node->child_count;
+	obj->storage_used = node->storage_used;
+	obj->didl = string_at(tree, node->didl);
+}
+
+const char *
+objtree_path(const struct objtree *tree, const struct objtree_node *node)
+{
+	return string_at(tree, node->path);
+}
@@ -0,0 +1,140 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __OBJTREE_H__
+#define __OBJTREE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sqlite3.h>
+
+#include "didl.h"
+
+/* A copy of OBJECTS in memory, for Browse and media lookups to read
+ * without going through SQLite, which remains where objects are stored.
+ * Objects are kept in one array in (PARENT, IDX) order, so the children of
+ * a container are next to each other in the order Browse lists them.
+ * Classes and MIME types are kept once each, other strings in one block.
+ *
+ * A tree is never changed once built.  When the database changes a new
+ * one replaces it, and the old one is freed once the last reader is done
+ * with it.
+ *
+ * Each tree built is also written to a catalog file next to the database,
+ * with no pointers in it, which the next start maps as it is. */
+
+#define OBJTREE_NONE	UINT32_MAX
+
+struct objtree;
+
+struct objtree_node
+{
+	int64_t key;		/* ID of the row */
+	int64_t idx;
+	int64_t size;		/* -1 for NULL, as are the other numbers */
+	int64_t storage_used;
+	int64_t child_count;
+	uint32_t parent;	/* index of the parent, OBJTREE_NONE for the root */
+	uint32_t first_child;	/* index of the first child, if any */
+	uint32_t children;
+	uint16_t class;		/* interned strings */
+	uint16_t mime;
+	uint32_t title;		/* offsets of strings, 0 for NULL */
+	uint32_t didl;
+	uint32_t path;
+	uint32_t update_id;	/* of a container, 0 for an item */
+};
+
+/**
+ * Build a tree from the database, write its catalog and make it the one
+ * objtree_get() returns.
+ * @param db The database connection, which should be the one writing to it.
+ * @return 0 on success, -1 on error, leaving the previous tree in place.
+ */
+int objtree_build(sqlite3 *db);
+
+/**
+ * Map the catalog if it was written for the database as it is, or else
+ * build the tree.
+ * @param db The database connection, which should be the one writing to it.
+ * @return 0 on success, -1 on error.
+ */
+int objtree_load(sqlite3 *db);
+
+/**
+ * Build the tree again if the database has changed since it was built,
+ * which must be before updateID is bumped for that change.
+ * @param db The connection objtree_build() was given.
+ * @param force Build it again even if that connection made no changes.
+ */
+void objtree_refresh(sqlite3 *db, int force);
+
+/**
+ * Take a reference to the current tree.
+ * @return The tree, to hand back with objtree_put(), or NULL if none.
+ */
+struct objtree *objtree_get(void);
+
+/**
+ * Hand back a reference taken with objtree_get().
+ */
+void objtree_put(struct objtree *tree);
+
+/**
+ * Drop the current tree.
+ */
+void objtree_shutdown(void);
+
+/**
+ * Find the object an ObjectID names, as object_key() does in the database.
+ * @param canon If not NULL, filled with the ObjectID as we would write it.
+ * @param len The size of canon.
+ * @return The object, or NULL if there is no such object.
+ */
+const struct objtree_node *objtree_find(const struct objtree *tree, const char *object_id,
+                                        char *canon, size_t len);
+
+/**
+ * @return The object with the ID key, or NULL if there is none.
+ */
+const struct objtree_node *objtree_lookup(const struct objtree *tree, int64_t key);
+
+/**
+ * @param count Filled with the number of children.
+ * @return The first child of an object, the others following it.
+ */
+const struct objtree_node *objtree_children(const struct objtree *tree,
+                                            const struct objtree_node *node, int *count);
+
+/**
+ * @return The parent of an object, or NULL for the root.
+ */
+const struct objtree_node *objtree_parent(const struct objtree *tree,
+                                          const struct objtree_node *node);
+
+/**
+ * Fill in the columns of an object, leaving its ObjectIDs alone.  The
+ * strings are only good for as long as the tree is held.
+ */
+void objtree_object(const struct objtree *tree, const struct objtree_node *node,
+                    struct didl_object *obj);
+
+/**
+ * @return The path of an object, or NULL if it has none.
+ */
+const char *objtree_path(const struct objtree *tree, const struct objtree_node *node);
+
+#endif // __OBJTREE_H__
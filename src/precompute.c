@@ -0,0 +1,265 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "upnpsoap.h"
+#include "precompute.h"
+#include "utils.h"
+#include "sql.h"
+#include "log.h"
+
+#define QUEUE_SIZE	16
+#define CLIENTS		32
+
+/* A page to build, owning copies of its request's strings */
+struct job {
+	struct in_addr client;
+	struct browse_request req;
+};
+
+/* What each client was last answered */
+static struct client {
+	struct in_addr addr;
+	time_t seen;
+	unsigned int listing;	/* the container, filter, sort and interface */
+	int next;		/* StartingIndex of the page after the last one */
+	int count;		/* RequestedCount of the last page */
+	int page_size;		/* set once two pages in a row were alike */
+} clients[CLIENTS];
+
+static pthread_t thread;
+static int started = 0;
+static int running = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static struct job queue[QUEUE_SIZE];
+static int count = 0;
+
+static unsigned int
+listing_hash(const struct browse_request *req)
+{
+	unsigned int hash = req->iface;
+
+	hash = hash * 31 + DJBHash((uint8_t *)req->object_id, strlen(req->object_id));
+	if (req->filter)
+		hash = hash * 31 + DJBHash((uint8_t *)req->filter, strlen(req->filter));
+	if (req->sort)
+		hash = hash * 31 + DJBHash((uint8_t *)req->sort, strlen(req->sort));
+
+	return hash;
+}
+
+/* The client's slot, taking over the one heard from least recently */
+static struct client *
+find_client(struct in_addr addr)
+{
+	struct client *c, *oldest = clients;
+
+	for (c = clients; c < clients + CLIENTS; c++)
+	{
+		if (c->addr.s_addr == addr.s_addr)
+			return c;
+		if (c->seen < oldest->seen)
+			oldest = c;
+	}
+	memset(oldest, 0, sizeof(*oldest));
+	oldest->addr = addr;
+
+	return oldest;
+}
+
+static void
+free_job(struct job *job)
+{
+	free((char *)job->req.object_id);
+	free((char *)job->req.filter);
+	free(job->req.sort);
+}
+
+static void
+drop_job(int i)
+{
+	free_job(&queue[i]);
+	memmove(&queue[i], &queue[i + 1], (count - i - 1) * sizeof(queue[0]));
+	count--;
+}
+
+/* Queue the page at start, in place of anything else queued for the client */
+static void
+queue_page(struct in_addr client, const struct browse_request *req, int start)
+{
+	struct job *job;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (queue[i].client.s_addr == client.s_addr)
+			drop_job(i--);
+	}
+	if (count == QUEUE_SIZE)
+		return;
+
+	job = &queue[count];
+	job->client = client;
+	job->req = *req;
+	job->req.browse_flag = "BrowseDirectChildren";
+	job->req.start = start;
+	job->req.object_id = strdup(req->object_id);
+	job->req.filter = req->filter ? strdup(req->filter) : NULL;
+	job->req.sort = req->sort ? strdup(req->sort) : NULL;
+	if (!job->req.object_id || (req->filter && !job->req.filter) ||
+	    (req->sort && !job->req.sort))
+	{
+		free_job(job);
+		return;
+	}
+	count++;
+	pthread_cond_signal(&cond);
+}
+
+static void *
+precompute_thread(void *arg)
+{
+	struct job job;
+
+	db = sql_reader_get();
+	if (!db)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Precompute thread failed to open database\n");
+		pthread_mutex_lock(&lock);
+		running = 0;
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&lock);
+	while (running)
+	{
+		if (!count)
+		{
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		job = queue[0];
+		memmove(&queue[0], &queue[1], (count - 1) * sizeof(queue[0]));
+		count--;
+		pthread_mutex_unlock(&lock);
+
+		DPRINTF(E_DEBUG, L_HTTP, "Precomputing %s from %d for %s\n",
+			job.req.object_id, job.req.start, inet_ntoa(job.client));
+		PrecomputeBrowse(&job.req);
+		free_job(&job);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	sql_reader_put(db);
+	db = NULL;
+
+	return NULL;
+}
+
+int
+precompute_init(void)
+{
+	sigset_t set, oldset;
+	int ret;
+
+	/* Nowhere to put the pages */
+	if (runtime_vars.browse_cache_size <= 0)
+		return 0;
+
+	running = 1;
+	/* keep signal handling in the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	ret = pthread_create(&thread, NULL, precompute_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ret != 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to start precompute thread: %s\n", strerror(ret));
+		running = 0;
+		return -1;
+	}
+	started = 1;
+
+	return 0;
+}
+
+void
+precompute_note(struct in_addr client, const struct browse_request *req, int total)
+{
+	struct client *c;
+	unsigned int listing;
+	int i;
+
+	if (!running || req->count <= 0 || strcmp(req->browse_flag, "BrowseDirectChildren") != 0)
+		return;
+
+	listing = listing_hash(req);
+	pthread_mutex_lock(&lock);
+	c = find_client(client);
+	if (c->listing != listing)
+	{
+		/* It left the container, the page coming for it is not wanted */
+		for (i = 0; i < count; i++)
+		{
+			if (queue[i].client.s_addr == client.s_addr)
+				drop_job(i--);
+		}
+		c->listing = listing;
+	}
+	else if (req->start == c->next && req->count == c->count)
+		c->page_size = req->count;
+	c->seen = time(NULL);
+	c->next = req->start + req->count;
+	c->count = req->count;
+	/* Only going by the page size it was seen using */
+	if (c->page_size == req->count && c->next < total)
+		queue_page(client, req, c->next);
+	pthread_mutex_unlock(&lock);
+}
+
+void
+precompute_shutdown(void)
+{
+	if (!started)
+		return;
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	started = 0;
+
+	while (count)
+		drop_job(0);
+}
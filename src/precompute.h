@@ -0,0 +1,46 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PRECOMPUTE_H__
+#define __PRECOMPUTE_H__
+
+#include <netinet/in.h>
+
+struct browse_request;
+
+/**
+ * Start the precompute thread.  Once a client has been seen paging through
+ * a container, each page it asks for has the next one built into the
+ * browse cache in the background.
+ * @return 0 on success or if the browse cache is disabled, -1 on error.
+ */
+int precompute_init(void);
+
+/**
+ * Tell what a client was answered, to learn its page size and queue the
+ * page it is likely to ask for next.  Never blocks on the database.
+ * @param client The address of the client.
+ * @param req The Browse request answered.
+ * @param total The TotalMatches answered.
+ */
+void precompute_note(struct in_addr client, const struct browse_request *req, int total);
+
+/**
+ * Stop the precompute thread.
+ */
+void precompute_shutdown(void);
+
+#endif // __PRECOMPUTE_H__
@@ -0,0 +1,235 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "upnpglobalvars.h"
+#include "prefetch.h"
+#include "utils.h"
+#include "sql.h"
+#include "log.h"
+
+#define QUEUE_SIZE	32
+/* Files prefetched within this many seconds are not prefetched again */
+#define RECENT_SIZE	16
+#define RECENT_TIME	60
+
+static pthread_t thread;
+static int running = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static char *queue[QUEUE_SIZE];
+static int head = 0, count = 0;
+
+static struct {
+	unsigned int hash;
+	time_t when;
+} recent[RECENT_SIZE];
+static int recent_next = 0;
+
+/* Token bucket of bytes we may read, refilled at prefetch_rate per second
+ * and holding at most one second worth. */
+static double tokens = 0;
+static struct timespec last_fill;
+
+static int
+seen_recently(const char *path)
+{
+	unsigned int hash = DJBHash((uint8_t *)path, strlen(path));
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < RECENT_SIZE; i++)
+	{
+		if (recent[i].hash == hash && now - recent[i].when < RECENT_TIME)
+			return 1;
+	}
+	recent[recent_next].hash = hash;
+	recent[recent_next].when = now;
+	recent_next = (recent_next + 1) % RECENT_SIZE;
+
+	return 0;
+}
+
+/* Wait until the budget allows reading len bytes */
+static void
+take_tokens(off_t len)
+{
+	struct timespec now, delay;
+	double rate = runtime_vars.prefetch_rate;
+	double need;
+
+	if (len > rate)
+		len = rate;
+	for (;;)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		tokens += rate * ((now.tv_sec - last_fill.tv_sec) +
+		                  (now.tv_nsec - last_fill.tv_nsec) / 1e9);
+		if (tokens > rate)
+			tokens = rate;
+		last_fill = now;
+		if (tokens >= len || !running)
+			break;
+		need = (len - tokens) / rate;
+		delay.tv_sec = (time_t)need;
+		delay.tv_nsec = (long)((need - delay.tv_sec) * 1e9);
+		nanosleep(&delay, NULL);
+	}
+	tokens -= len;
+}
+
+static void
+prefetch_file(const char *path)
+{
+	struct stat st;
+	off_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	len = runtime_vars.prefetch_window;
+	if (fstat(fd, &st) == 0 && st.st_size < len)
+		len = st.st_size;
+	take_tokens(len);
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+#endif
+	DPRINTF(E_DEBUG, L_GENERAL, "Prefetched %lld bytes of %s\n", (long long)len, path);
+	close(fd);
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+	char *path;
+
+	pthread_mutex_lock(&lock);
+	while (running)
+	{
+		if (!count)
+		{
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		path = queue[head];
+		head = (head + 1) % QUEUE_SIZE;
+		count--;
+		pthread_mutex_unlock(&lock);
+
+		prefetch_file(path);
+		free(path);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+int
+prefetch_init(void)
+{
+	sigset_t set, oldset;
+	int ret;
+
+	if (runtime_vars.prefetch_window <= 0 || runtime_vars.prefetch_rate <= 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &last_fill);
+	running = 1;
+	/* keep signal handling in the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	ret = pthread_create(&thread, NULL, prefetch_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ret != 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to start prefetch thread: %s\n", strerror(ret));
+		running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+prefetch_hint(const char *path)
+{
+	char *copy;
+
+	if (!running || !path)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (count < QUEUE_SIZE && !seen_recently(path) && (copy = strdup(path)))
+	{
+		queue[(head + count) % QUEUE_SIZE] = copy;
+		count++;
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void
+prefetch_hint_lookup(const char *sql, int64_t key)
+{
+	sqlite3_stmt *stmt;
+
+	if (!running)
+		return;
+
+	stmt = sql_bind_cached(db, sql, "I", key);
+	if (!stmt)
+		return;
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+		prefetch_hint((const char *)sqlite3_column_text(stmt, 0));
+	sqlite3_reset(stmt);
+}
+
+void
+prefetch_shutdown(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+
+	while (count)
+	{
+		free(queue[head]);
+		head = (head + 1) % QUEUE_SIZE;
+		count--;
+	}
+}
@@ -0,0 +1,55 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stdint.h>
+
+/* How many of the first items of a browsed folder to prefetch */
+#define PREFETCH_BROWSE_ITEMS	2
+/* A range request past this percentage of a file prefetches the next one */
+#define PREFETCH_NEAR_END	80
+
+/**
+ * Start the prefetch thread.  It warms the page cache with the first
+ * runtime_vars.prefetch_window bytes of the files it is hinted at, reading
+ * no more than runtime_vars.prefetch_rate bytes per second overall.
+ * @return 0 on success or if prefetching is disabled, -1 on error.
+ */
+int prefetch_init(void);
+
+/**
+ * Ask for a file to be prefetched.  Never blocks; hints are dropped if
+ * the queue is full or the file was prefetched recently.
+ * @param path The file to prefetch.
+ */
+void prefetch_hint(const char *path);
+
+/**
+ * Run a query on this thread's database connection and prefetch the
+ * files named in the first column of its result.
+ * @param sql The query, kept prepared, with a single parameter.
+ * @param key The value bound to the parameter.
+ */
+void prefetch_hint_lookup(const char *sql, int64_t key);
+
+/**
+ * Stop the prefetch thread.
+ */
+void prefetch_shutdown(void);
+
+#endif // __PREFETCH_H__
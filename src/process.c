@@ -40,6 +40,7 @@
 
 #include "upnpglobalvars.h"
 #include "process.h"
+#include "streamer.h"
 #include "config.h"
 #include "log.h"
 
@@ -55,9 +56,9 @@ add_process_info(pid_t pid)
 	for (i = 0; i < runtime_vars.max_connections; i++)
 	{
 		child = children+i;
-		if (child->pid)
+		/* HTTP worker threads may fork concurrently */
+		if (!__sync_bool_compare_and_swap(&child->pid, 0, pid))
 			continue;
-		child->pid = pid;
 		child->age = time(NULL);
 		break;
 	}
@@ -82,8 +83,9 @@ remove_process_info(pid_t pid)
 pid_t
 process_fork(void)
 {
-	if (number_of_children >= runtime_vars.max_connections)
+	if (__sync_add_and_fetch(&number_of_children, 1) > runtime_vars.max_connections)
 	{
+		__sync_sub_and_fetch(&number_of_children, 1);
 		DPRINTF(E_WARN, L_GENERAL, "Exceeded max connections [%d], not forking\n",
 			runtime_vars.max_connections);
 		errno = EAGAIN;
@@ -92,10 +94,9 @@ process_fork(void)
 
 	pid_t pid = fork();
 	if (pid > 0)
-	{
 		add_process_info(pid);
-		number_of_children++;
-	}
+	else if (pid < 0)
+		__sync_sub_and_fetch(&number_of_children, 1);
 
 	return pid;
 }
@@ -114,7 +115,9 @@ process_handle_child_termination(int signal)
 			else
 				break;
 		}
-		number_of_children--;
+		if (streamer_child_exited(pid))
+			continue;
+		__sync_sub_and_fetch(&number_of_children, 1);
 		remove_process_info(pid);
 	}
 }
@@ -0,0 +1,237 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "upnpglobalvars.h"
+#include "restart.h"
+#include "streamer.h"
+#include "process.h"
+#include "utils.h"
+#include "log.h"
+#include "sendfile.h"
+
+int
+restart_exec(char **argv)
+{
+	char buf[16];
+	char path[PATH_MAX];
+	ssize_t len;
+	int sv[2];
+	pid_t pid;
+	int i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "restart socketpair(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0)
+	{
+		/* Leave the new instance nothing but the handoff socket: the
+		 * listeners come through it, and connections left open here
+		 * would never be closed */
+		for (i = getdtablesize(); i > 2; --i)
+			if (i != sv[1])
+				close(i);
+		snprintf(buf, sizeof(buf), "%d", sv[1]);
+		setenv(RESTART_ENV, buf, 1);
+		/* Run whatever binary is installed at our path now, so this also
+		 * works for upgrades.  Executing /proc/self/exe directly would
+		 * rename the process to "exe". */
+		len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+		if (len > 0)
+		{
+			path[len] = '\0';
+			if (ends_with(path, " (deleted)"))
+				path[len - 10] = '\0';
+			execv(path, argv);
+		}
+		execv("/proc/self/exe", argv);
+		DPRINTF(E_ERROR, L_GENERAL, "restart execv(): %s\n", strerror(errno));
+		_exit(1);
+	}
+	close(sv[1]);
+	if (pid < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "restart fork(): %s\n", strerror(errno));
+		close(sv[0]);
+		return -1;
+	}
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	DPRINTF(E_WARN, L_GENERAL, "Started new instance %d\n", (int)pid);
+
+	return sv[0];
+}
+
+int
+restart_send_listener(int s, int type, int fd)
+{
+	struct restart_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+
+	return send_fds(s, &msg, sizeof(msg), &fd, fd < 0 ? 0 : 1);
+}
+
+int
+restart_send_stream(int s, int sock, int fd, off_t offset, off_t end)
+{
+	struct restart_msg msg;
+	int fds[2];
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = RESTART_STREAM;
+	msg.offset = offset;
+	msg.end = end;
+	fds[0] = sock;
+	fds[1] = fd;
+
+	return send_fds(s, &msg, sizeof(msg), fds, 2);
+}
+
+/* Carry on with a transfer the old instance was in the middle of */
+static void
+resume_stream(int sock, int fd, off_t offset, off_t end)
+{
+	ssize_t ret;
+	pid_t pid;
+
+	if (streamer_enabled() && streamer_submit(sock, fd, offset, end) == 0)
+	{
+		close(sock);
+		close(fd);
+		return;
+	}
+
+	pid = process_fork();
+	if (pid != 0)
+	{
+		if (pid < 0)
+			DPRINTF(E_ERROR, L_HTTP, "Dropping transfer to %d, could not fork\n", sock);
+		close(sock);
+		close(fd);
+		return;
+	}
+
+	/* pool workers leave the socket non-blocking */
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+	while (offset <= end)
+	{
+		ret = sys_sendfile(sock, fd, &offset, MIN(end - offset + 1, 2147483647));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+	}
+	_exit(0);
+}
+
+int
+restart_receive(int *http, int max, int *nhttp, int *sssdp)
+{
+	struct restart_msg msg;
+	int fds[UTILS_MAX_FDS];
+	int nfds;
+	const char *env;
+	ssize_t len;
+	char ready = 1;
+	int s, i;
+
+	*nhttp = 0;
+	*sssdp = -1;
+	env = getenv(RESTART_ENV);
+	if (!env)
+		return -1;
+	s = atoi(env);
+	unsetenv(RESTART_ENV);
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+
+	/* Tell the old instance we are up; it answers with its listeners */
+	if (send(s, &ready, 1, MSG_NOSIGNAL) != 1)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Hot restart handoff failed: %s\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+	while ((len = recv_fds(s, &msg, sizeof(msg), fds, &nfds)) > 0)
+	{
+		if (len == sizeof(msg) && msg.type == RESTART_READY)
+			break;
+		if (len == sizeof(msg) && msg.type == RESTART_HTTP && nfds == 1 && *nhttp < max)
+		{
+			http[(*nhttp)++] = fds[0];
+			continue;
+		}
+		if (len == sizeof(msg) && msg.type == RESTART_SSDP && nfds == 1 && *sssdp < 0)
+		{
+			*sssdp = fds[0];
+			continue;
+		}
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+	}
+	DPRINTF(E_WARN, L_GENERAL, "Hot restart: took over %d HTTP listeners and %s SSDP socket\n",
+		*nhttp, *sssdp >= 0 ? "the" : "no");
+	if (len <= 0)
+	{
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+int
+restart_process(int s)
+{
+	struct restart_msg msg;
+	int fds[UTILS_MAX_FDS];
+	int nfds, i;
+	ssize_t len;
+
+	len = recv_fds(s, &msg, sizeof(msg), fds, &nfds);
+	if (len < 0 && errno == EAGAIN)
+		return 0;
+	if (len <= 0)
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Hot restart complete\n");
+		return -1;
+	}
+	if (len == sizeof(msg) && msg.type == RESTART_STREAM && nfds == 2)
+	{
+		DPRINTF(E_INFO, L_HTTP, "Resuming transfer at offset %lld\n", (long long)msg.offset);
+		resume_stream(fds[0], fds[1], msg.offset, msg.end);
+		return 0;
+	}
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+
+	return 0;
+}
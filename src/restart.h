@@ -0,0 +1,83 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RESTART_H__
+#define __RESTART_H__
+
+#include <sys/types.h>
+
+/* Environment variable holding the handoff socket of a hot restart */
+#define RESTART_ENV	"MINIDLNA_RESTART_FD"
+
+enum restart_type {
+	RESTART_HTTP,	/* an HTTP listener */
+	RESTART_SSDP,	/* the SSDP receive socket */
+	RESTART_READY,	/* no more listeners follow */
+	RESTART_STREAM	/* a transfer in progress: socket, file, offset, end */
+};
+
+/* One message on the handoff socket, carrying its descriptors along */
+struct restart_msg {
+	int type;
+	off_t offset;
+	off_t end;
+};
+
+/**
+ * Start a new instance of ourselves with the same arguments, and open the
+ * handoff socket to it.
+ * @param argv The arguments we were started with.
+ * @return The handoff socket, or -1 on error.
+ */
+int restart_exec(char **argv);
+
+/**
+ * Pass a listening socket to the new instance.
+ * @param s The handoff socket.
+ * @param type RESTART_HTTP, RESTART_SSDP, or RESTART_READY once all
+ *        listeners have been sent.
+ * @param fd The socket to pass, -1 for RESTART_READY.
+ * @return 0 on success, -1 on error.
+ */
+int restart_send_listener(int s, int type, int fd);
+
+/**
+ * Pass a transfer in progress to the new instance.
+ * @return 0 on success, -1 on error.
+ */
+int restart_send_stream(int s, int sock, int fd, off_t offset, off_t end);
+
+/**
+ * In the new instance, take over the listeners of the old one.
+ * @param http Filled with the inherited HTTP listeners.
+ * @param max The size of http.
+ * @param nhttp Set to the number of HTTP listeners.
+ * @param sssdp Set to the inherited SSDP socket, or -1.
+ * @return The handoff socket if we were started by a hot restart, on which
+ *         transfers will follow, -1 otherwise.
+ */
+int restart_receive(int *http, int max, int *nhttp, int *sssdp);
+
+/**
+ * Resume the next transfer the old instance handed us.  Called from the
+ * main loop when the handoff socket is readable.
+ * @param s The handoff socket.
+ * @return 0 to keep going, -1 once the old instance is done; the caller
+ *         then closes s.
+ */
+int restart_process(int s);
+
+#endif // __RESTART_H__
@@ -42,6 +42,8 @@
 #include "utils.h"
 #include "sql.h"
 #include "scanner.h"
+#include "objectid.h"
+#include "didl.h"
 #include "log.h"
 
 #if SCANDIR_CONST
@@ -55,6 +57,12 @@ typedef struct dirent scan_filter;
 
 int valid_cache = 0;
 
+/* Objects the scan inserts per transaction: committing each one alone
+ * costs a WAL append apiece, while readers should still see the scan
+ * progress */
+#define SCAN_BATCH	1000
+static int scan_pending;
+
 struct virtual_item
 {
 	int64_t objectID;
@@ -63,87 +71,275 @@ struct virtual_item
 };
 
 int64_t
-get_next_available_id(const char *table, const char *parentID)
+get_next_available_id(const char *table, int64_t parent)
 {
-		char *ret, *base;
-		int64_t objectID = 0;
-
-		ret = sql_get_text_field(db, "SELECT OBJECT_ID from %s where ID = "
-		                             "(SELECT max(ID) from %s where PARENT_ID = '%s')",
-		                             table, table, parentID);
-		if( ret )
-		{
-			base = strrchr(ret, '$');
-			if( base )
-				objectID = strtoll(base+1, NULL, 16) + 1;
-			sqlite3_free(ret);
-		}
+		return sql_get_int_field(db, "SELECT max(IDX) + 1 from %s where PARENT = %lld",
+		                         table, (long long)parent);
+}
 
-		return objectID;
+/* The UpdateID of the containers the scan changes: the updateID the change
+ * is published under once it is done */
+static inline int64_t
+scan_update_id(void)
+{
+	return (int64_t)updateID + 1;
 }
 
-void
-insert_directory(const char *name, const char *path, const char *base, const char *parentID, int objectID)
+int64_t
+insert_directory(const char *name, const char *path, int64_t parent, int idx)
 {
 	char class[] = "container.storageFolder";
+	char *didl = didl_fragment(class, name, NULL, NULL);
+	int ret;
 	
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, CLASS, TITLE, PATH) "
+	ret = sql_exec_cached(db, "INSERT into OBJECTS"
+	             " (PARENT, IDX, CLASS, TITLE, PATH, CHILD_COUNT, STORAGE_USED, DIDL, UPDATE_ID) "
 	             "VALUES"
-	             " ('%s%s$%X', '%s%s', '%s', '%q', %Q)",
-	             base, parentID, objectID, base, parentID, class, name, path);
+	             " (?, ?, ?, ?, ?, 0, 0, ?, ?)",
+	             "IittttI", parent, idx, class, name, path, didl, scan_update_id());
+	free(didl);
+	if (ret != SQLITE_OK)
+		return -1;
 
-	return;
+	return sqlite3_last_insert_rowid(db);
 }
 
-int
-insert_file(const char *name, const char *path, const char *parentID, int object, media_types types)
+int64_t
+insert_file(const char *name, const char *path, int64_t parent, int idx, media_types types)
 {
 	const char *class;
-	char objectID[64];
-	char base[8];
 	media_types mtype = get_media_type(name);
 
 	if( mtype == TYPE_VIDEO && (types & TYPE_VIDEO) )
 	{
 		metadata_t meta;
-		strcpy(base, VIDEO_DIR_ID);
+		char size[24], *didl;
+		int ret;
 		class = "item.videoItem";
 		GetVideoMetadata(&meta, path, name);
 
-		sprintf(objectID, "%s%s$%X", BROWSEDIR_ID, parentID, object);
-
-		sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, CLASS, PATH, SIZE, TITLE, MIME) "
+		snprintf(size, sizeof(size), "%lld", (long long)meta.file_size);
+		didl = didl_fragment(class, meta.title, meta.mime, size);
+		ret = sql_exec_cached(db, "INSERT into OBJECTS"
+	             " (PARENT, IDX, CLASS, PATH, SIZE, TITLE, MIME, DIDL) "
 	             "VALUES"
-	             " ('%s', '%s%s', '%s', %Q, %lld, '%q', '%q')",
-	             objectID, BROWSEDIR_ID, parentID, class, path, (long long)meta.file_size, meta.title, meta.mime);
+	             " (?, ?, ?, ?, ?, ?, ?, ?)",
+	             "IittIttt", parent, idx, class, path, (int64_t)meta.file_size, meta.title, meta.mime, didl);
+		free(didl);
+		if (ret != SQLITE_OK)
+			return -1;
+		return meta.file_size;
+	}
+
+	return -1;
+}
+
+int
+update_container_totals(int64_t container, int children, int64_t bytes)
+{
+	int ret;
+
+	ret = sql_exec_cached(db, "UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + ? where ID = ?",
+	                      "iI", children, container);
+	/* Everything above the container holds the bytes too, and lists
+	 * something that changed, up to the root */
+	if (ret == SQLITE_OK && (children || bytes))
+		ret = sql_exec_cached(db, "WITH RECURSIVE UP(ID) as (SELECT ?1 UNION ALL "
+		                          "SELECT PARENT from OBJECTS, UP where OBJECTS.ID = UP.ID and PARENT != 0) "
+		                          "UPDATE OBJECTS set STORAGE_USED = STORAGE_USED + ?2, UPDATE_ID = ?3 "
+		                          "where ID in UP",
+		                          "III", container, bytes, scan_update_id());
+
+	return ret;
+}
+
+int
+CountContainerTotals(sqlite3 *db)
+{
+	int ret;
+
+	ret = sql_exec(db, "UPDATE OBJECTS set STORAGE_USED = 0, "
+	                   "CHILD_COUNT = (SELECT count(*) from OBJECTS c where c.PARENT = OBJECTS.ID) "
+	                   "where CLASS like 'container%%'");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "CREATE TEMP TABLE STORAGE as "
+		                   "WITH RECURSIVE UP(ID, SIZE) as ("
+		                   "SELECT PARENT, SIZE from OBJECTS where CLASS like 'item%%' and SIZE > 0 UNION ALL "
+		                   "SELECT o.PARENT, UP.SIZE from OBJECTS o, UP where o.ID = UP.ID and o.PARENT != 0) "
+		                   "SELECT ID, sum(SIZE) as SIZE from UP group by ID");
+	if (ret == SQLITE_OK)
+	{
+		ret = sql_exec(db, "UPDATE OBJECTS set STORAGE_USED = "
+		                   "(SELECT SIZE from temp.STORAGE s where s.ID = OBJECTS.ID) "
+		                   "where ID in (SELECT ID from temp.STORAGE)");
+		sql_exec(db, "DROP TABLE temp.STORAGE");
+	}
+
+	return ret;
+}
+
+/* DIDL_FRAGMENT(CLASS, TITLE, MIME, SIZE) */
+static void
+didl_fragment_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	char *didl;
+
+	didl = didl_fragment((const char *)sqlite3_value_text(argv[0]),
+	                     (const char *)sqlite3_value_text(argv[1]),
+	                     (const char *)sqlite3_value_text(argv[2]),
+	                     (const char *)sqlite3_value_text(argv[3]));
+	if (didl)
+		sqlite3_result_text(ctx, didl, -1, free);
+	else
+		sqlite3_result_error_nomem(ctx);
+}
+
+int
+UpdateFragments(sqlite3 *db)
+{
+	int ret;
+
+	if (sql_get_int_field(db, "SELECT VALUE from SETTINGS where KEY = 'DIDL_VERSION'") == DIDL_VERSION)
+		return SQLITE_OK;
+
+	DPRINTF(E_WARN, L_DB_SQL, "Rendering DIDL-Lite fragments for version %d\n", DIDL_VERSION);
+	ret = sqlite3_create_function(db, "DIDL_FRAGMENT", 4, SQLITE_UTF8, NULL, didl_fragment_func, NULL, NULL);
+	if (ret != SQLITE_OK)
+		return ret;
+	ret = sql_exec(db, "BEGIN");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "UPDATE OBJECTS set DIDL = DIDL_FRAGMENT(CLASS, TITLE, MIME, SIZE)");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "INSERT or REPLACE into SETTINGS VALUES ('DIDL_VERSION', %d)", DIDL_VERSION);
+	/* The catalog has the old fragments */
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "DELETE from SETTINGS where KEY = 'CATALOG'");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "COMMIT");
+	if (ret != SQLITE_OK)
+	{
+		sql_exec(db, "ROLLBACK");
+		/* Fragments of another version would be wrong, render
+		 * every object as it is served instead */
+		sql_exec(db, "BEGIN");
+		sql_exec(db, "UPDATE OBJECTS set DIDL = NULL");
+		sql_exec(db, "DELETE from SETTINGS where KEY = 'CATALOG'");
+		sql_exec(db, "COMMIT");
 	}
+	sqlite3_create_function(db, "DIDL_FRAGMENT", 4, SQLITE_UTF8, NULL, NULL, NULL, NULL);
+
+	return ret;
+}
 
-	return 0;
+int
+CreateIndexes(sqlite3 *db)
+{
+	return sql_exec(db, create_objectIndexes_sqlite);
+}
+
+int
+CreateSettings(sqlite3 *db)
+{
+	return sql_exec(db, create_settingsTable_sqlite);
+}
+
+/* The IDX of a v12 OBJECT_ID: its last component, in hex */
+static void
+object_idx(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *id = (const char *)sqlite3_value_text(argv[0]);
+	const char *p;
+
+	if (!id)
+	{
+		sqlite3_result_null(ctx);
+		return;
+	}
+	p = strrchr(id, '$');
+	sqlite3_result_int64(ctx, strtoll(p ? p + 1 : id, NULL, 16));
+}
+
+int
+UpgradeObjectKeys(sqlite3 *db)
+{
+	int ret;
+
+	ret = sqlite3_create_function(db, "OBJECT_IDX", 1, SQLITE_UTF8, NULL, object_idx, NULL, NULL);
+	if (ret != SQLITE_OK)
+		return ret;
+	ret = sql_exec(db, "BEGIN");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "ALTER TABLE OBJECTS RENAME TO OBJECTS_OLD");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, create_objectTable_sqlite);
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "INSERT into OBJECTS (ID, PARENT, IDX, CLASS, PATH, SIZE, TITLE, MIME) "
+		                   "SELECT o.ID, coalesce(p.ID, 0), OBJECT_IDX(o.OBJECT_ID), "
+		                   "o.CLASS, o.PATH, o.SIZE, o.TITLE, o.MIME "
+		                   "from OBJECTS_OLD o left join OBJECTS_OLD p on p.OBJECT_ID = o.PARENT_ID");
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "DROP TABLE OBJECTS_OLD");
+	if (ret == SQLITE_OK)
+		ret = CreateIndexes(db);
+	if (ret == SQLITE_OK)
+		ret = sql_exec(db, "COMMIT");
+	if (ret != SQLITE_OK)
+		sql_exec(db, "ROLLBACK");
+	sqlite3_create_function(db, "OBJECT_IDX", 1, SQLITE_UTF8, NULL, NULL, NULL, NULL);
+
+	return ret;
+}
+
+int
+CreateSearchIndex(sqlite3 *db)
+{
+	int ret;
+
+	/* the trigram tokenizer came with 3.34 */
+	if (!sqlite3_compileoption_used("ENABLE_FTS5") || sqlite3_libversion_number() < 3034000)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "SQLite has no FTS5 trigram support, Search will scan titles\n");
+		return SQLITE_OK;
+	}
+	ret = sql_exec(db, "SAVEPOINT FTS");
+	if (ret == SQLITE_OK)
+	{
+		ret = sql_exec(db, create_searchIndex_sqlite);
+		if (ret != SQLITE_OK)
+			sql_exec(db, "ROLLBACK TO FTS");
+		sql_exec(db, "RELEASE FTS");
+	}
+
+	return ret;
 }
 
 int
 CreateDatabase(void)
 {
-	int ret, i;
-	const char *containers[] = { "0","-1",   "root",
-	                    		BROWSEDIR_ID, "0", _("VIDEO"),
-						       0};
+	int ret;
+	int64_t root;
 
 	ret = sql_exec(db, create_objectTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = CreateIndexes(db);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = CreateSearchIndex(db);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = CreateSettings(db);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, "INSERT into SETTINGS VALUES ('DIDL_VERSION', %d)", DIDL_VERSION);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 
-	for( i=0; containers[i]; i=i+3 )
-	{
-		ret = sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, TITLE, PATH)"
-		                   " values "
-		                   "('%s', '%s', 'container.storageFolder', '%q', %Q)",
-		                   containers[i], containers[i+1], containers[i+2], NULL);
-		if( ret != SQLITE_OK )
-			goto sql_failed;
-	}
+	/* "0" and "64" */
+	root = insert_directory("root", NULL, 0, 0);
+	if( root < 0 || insert_directory(_("VIDEO"), NULL, root, BROWSEDIR_IDX) < 0 ||
+	    update_container_totals(root, 1, 0) != SQLITE_OK )
+		ret = SQLITE_ERROR;
 
 sql_failed:
 	if( ret != SQLITE_OK )
@@ -180,11 +376,26 @@ filter_v(scan_filter *d)
 		);
 }
 
+/* Commit the scan so far once it makes a batch, or whatever there is at
+ * the end of it */
 static void
-ScanDirectory(const char *dir, const char *parent, media_types dir_types)
+scan_commit(int final)
+{
+	if (!final && ++scan_pending < SCAN_BATCH)
+		return;
+	/* If it fails the transaction stays open, for the next one */
+	if (sql_exec_cached(db, "COMMIT", "") == SQLITE_OK && !final)
+		sql_exec_cached(db, "BEGIN", "");
+	scan_pending = 0;
+}
+
+static void
+ScanDirectory(const char *dir, int64_t parent, media_types dir_types)
 {
 	struct dirent **namelist;
-	int i, n, startID = 0;
+	int i, n, startID = 0, top = 0;
+	int children = 0;
+	int64_t size, bytes = 0;
 	char *full_path;
 	char *name = NULL;
 	static long long unsigned int fileno = 0;
@@ -208,14 +419,16 @@ ScanDirectory(const char *dir, const char *parent, media_types dir_types)
 
 	if( !parent )
 	{
-		startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
+		parent = object_key(db, BROWSEDIR_ID, NULL, 0);
+		startID = get_next_available_id("OBJECTS", parent);
+		top = 1;
 	}
 
 	for (i=0; i < n; i++)
 	{
 		type = TYPE_UNKNOWN;
 		snprintf(full_path, PATH_MAX, "%s/%s", dir, namelist[i]->d_name);
-		name = escape_tag(namelist[i]->d_name, 1);
+		name = namelist[i]->d_name;
 
 		if( is_dir(namelist[i]) == 1 )
 		{
@@ -228,23 +441,31 @@ ScanDirectory(const char *dir, const char *parent, media_types dir_types)
 
 		if( (type == TYPE_DIR) && (access(full_path, R_OK|X_OK) == 0) )
 		{
-			char *parent_id;
-			insert_directory(name, full_path, BROWSEDIR_ID, THISORNUL(parent), i+startID);
-			xasprintf(&parent_id, "%s$%X", THISORNUL(parent), i+startID);
-			ScanDirectory(full_path, parent_id, dir_types);
-			free(parent_id);
+			int64_t key = insert_directory(name, full_path, parent, i+startID);
+			if( key > 0 )
+			{
+				children++;
+				scan_commit(0);
+				ScanDirectory(full_path, key, dir_types);
+			}
 		}
 		else if( type == TYPE_FILE && (access(full_path, R_OK) == 0) )
 		{
-			if( insert_file(name, full_path, THISORNUL(parent), i+startID, dir_types) == 0 )
+			if( (size = insert_file(name, full_path, parent, i+startID, dir_types)) >= 0 )
+			{
+				children++;
+				bytes += size;
 				fileno++;
+				scan_commit(0);
+			}
 		}
-		free(name);
 		free(namelist[i]);
 	}
 	free(namelist);
 	free(full_path);
-	if( !parent )
+	/* Subdirectories have added their own totals already */
+	update_container_totals(parent, children, bytes);
+	if( top )
 	{
 		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, fileno);
 	}
@@ -255,7 +476,6 @@ start_scanner(void)
 {
 	struct media_dir_s *media_path;
 	char path[MAXPATHLEN];
-	char *parent = NULL;
 
 	if (setpriority(PRIO_PROCESS, 0, 15) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce scanner thread priority\n");
@@ -267,7 +487,9 @@ start_scanner(void)
 
 	strncpyt(path, media_path->path, sizeof(path));
 
-	ScanDirectory(media_path->path, parent, media_path->types);
+	sql_exec_cached(db, "BEGIN", "");
+	ScanDirectory(media_path->path, 0, media_path->types);
+	scan_commit(1);
 
 	DPRINTF(E_DEBUG, L_SCANNER, "Initial file scan completed\n");
 	//JM: Set up a db version number, so we know if we need to rebuild due to a new structure.
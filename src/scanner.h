@@ -24,8 +24,11 @@
 #ifndef __SCANNER_H__
 #define __SCANNER_H__
 
+#include <sqlite3.h>
+
 /* Try to be generally PlaysForSure compatible by using similar IDs */
 #define BROWSEDIR_ID		"64"
+#define BROWSEDIR_IDX		0x64
 
 #define MUSIC_ID		"1"
 #define MUSIC_ALL_ID		"1$4"
@@ -68,13 +71,34 @@ int
 is_image(const char *file);
 
 int64_t
-get_next_available_id(const char *table, const char *parentID);
+get_next_available_id(const char *table, int64_t parent);
 
-void
-insert_directory(const char *name, const char *path, const char *base, const char *parentID, int objectID);
+int64_t
+insert_directory(const char *name, const char *path, int64_t parent, int idx);
+
+int64_t
+insert_file(const char *name, const char *path, int64_t parent, int idx, media_types dir_types);
+
+int
+update_container_totals(int64_t container, int children, int64_t bytes);
+
+int
+CreateIndexes(sqlite3 *db);
+
+int
+CreateSettings(sqlite3 *db);
+
+int
+UpgradeObjectKeys(sqlite3 *db);
+
+int
+CountContainerTotals(sqlite3 *db);
+
+int
+CreateSearchIndex(sqlite3 *db);
 
 int
-insert_file(const char *name, const char *path, const char *parentID, int object, media_types dir_types);
+UpdateFragments(sqlite3 *db);
 
 int
 CreateDatabase(void);
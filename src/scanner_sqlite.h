@@ -24,11 +24,43 @@
 
 char create_objectTable_sqlite[] = "CREATE TABLE OBJECTS ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
-					"OBJECT_ID TEXT UNIQUE NOT NULL, "
-					"PARENT_ID TEXT NOT NULL, "
+					"PARENT INTEGER NOT NULL, "
+					"IDX INTEGER NOT NULL, "
 					"CLASS TEXT NOT NULL, "
 					"PATH TEXT DEFAULT NULL, "
 					"SIZE INTEGER, "
 					"TITLE TEXT COLLATE NOCASE, "
-					"MIME TEXT"
-					");";
\ No newline at end of file
+					"MIME TEXT, "
+					"CHILD_COUNT INTEGER, "
+					"STORAGE_USED INTEGER, "
+					"DIDL TEXT, "
+					"UPDATE_ID INTEGER"
+					");";
+
+char create_settingsTable_sqlite[] = "CREATE TABLE IF NOT EXISTS SETTINGS ("
+					"KEY TEXT PRIMARY KEY, "
+					"VALUE TEXT"
+					");";
+
+/* ObjectIDs are resolved one (PARENT, IDX) step at a time, and Browse lists
+ * a container by PARENT in IDX order, or in the order of one of the sort
+ * capabilities with IDX breaking ties.  Events list the containers changed
+ * since the last by UPDATE_ID. */
+char create_objectIndexes_sqlite[] = "CREATE UNIQUE INDEX IF NOT EXISTS IDX_OBJECTS_PARENT_IDX ON OBJECTS(PARENT, IDX);"
+					"CREATE INDEX IF NOT EXISTS IDX_OBJECTS_PARENT_TITLE ON OBJECTS(PARENT, TITLE, IDX);"
+					"CREATE INDEX IF NOT EXISTS IDX_OBJECTS_PARENT_CLASS ON OBJECTS(PARENT, CLASS, IDX);"
+					"CREATE INDEX IF NOT EXISTS IDX_OBJECTS_PARENT_SIZE ON OBJECTS(PARENT, ifnull(SIZE, -1), IDX);"
+					"CREATE INDEX IF NOT EXISTS IDX_OBJECTS_UPDATE_ID ON OBJECTS(UPDATE_ID) where UPDATE_ID is not NULL;";
+
+/* Search looks titles up by substring in a trigram index, which triggers
+ * keep in step with OBJECTS whoever writes to it. */
+char create_searchIndex_sqlite[] = "CREATE VIRTUAL TABLE OBJECTS_FTS USING fts5"
+					"(TITLE, content='OBJECTS', content_rowid='ID', tokenize='trigram');"
+					"CREATE TRIGGER OBJECTS_FTS_INSERT AFTER INSERT ON OBJECTS BEGIN "
+					"INSERT into OBJECTS_FTS (rowid, TITLE) VALUES (new.ID, new.TITLE); END;"
+					"CREATE TRIGGER OBJECTS_FTS_DELETE AFTER DELETE ON OBJECTS BEGIN "
+					"INSERT into OBJECTS_FTS (OBJECTS_FTS, rowid, TITLE) VALUES ('delete', old.ID, old.TITLE); END;"
+					"CREATE TRIGGER OBJECTS_FTS_UPDATE AFTER UPDATE OF TITLE ON OBJECTS BEGIN "
+					"INSERT into OBJECTS_FTS (OBJECTS_FTS, rowid, TITLE) VALUES ('delete', old.ID, old.TITLE); "
+					"INSERT into OBJECTS_FTS (rowid, TITLE) VALUES (new.ID, new.TITLE); END;"
+					"INSERT into OBJECTS_FTS (OBJECTS_FTS) VALUES ('rebuild');";
@@ -0,0 +1,388 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sqlite3.h>
+
+#include "search.h"
+
+/* Deepest nesting of parentheses we accept */
+#define MAX_DEPTH	32
+/* The trigram tokenizer cannot look up anything shorter */
+#define FTS_MIN_CHARS	3
+
+enum token {
+	T_END,
+	T_LPAREN,
+	T_RPAREN,
+	T_STRING,
+	T_WORD,
+	T_ERROR
+};
+
+struct parser {
+	const char *p;
+	int fts;
+	int depth;
+	enum token type;
+	char *text;
+};
+
+enum prop_type {
+	PROP_TITLE,
+	PROP_CLASS,
+	PROP_NUMBER
+};
+
+static const struct {
+	const char *name;
+	const char *column;
+	enum prop_type type;
+} properties[] = {
+	{ "dc:title",	"TITLE",	PROP_TITLE },
+	/* classes are stored without their "object." prefix */
+	{ "upnp:class",	"('object.' || CLASS)",	PROP_CLASS },
+	{ "res@size",	"SIZE",		PROP_NUMBER },
+	{ NULL, NULL, 0 }
+};
+
+static const char *rel_ops[] = { "=", "!=", "<", "<=", ">", ">=", NULL };
+
+static void
+next_token(struct parser *ps)
+{
+	const char *start;
+	char *out;
+
+	free(ps->text);
+	ps->text = NULL;
+
+	while (isspace((unsigned char)*ps->p))
+		ps->p++;
+	switch (*ps->p)
+	{
+	case '\0':
+		ps->type = T_END;
+		return;
+	case '(':
+		ps->p++;
+		ps->type = T_LPAREN;
+		return;
+	case ')':
+		ps->p++;
+		ps->type = T_RPAREN;
+		return;
+	case '"':
+		/* quoted values may escape '"' and '\' with a backslash */
+		out = ps->text = malloc(strlen(ps->p));
+		if (!out)
+			break;
+		for (ps->p++; *ps->p && *ps->p != '"'; ps->p++)
+		{
+			if (*ps->p == '\\' && (ps->p[1] == '"' || ps->p[1] == '\\'))
+				ps->p++;
+			*out++ = *ps->p;
+		}
+		*out = '\0';
+		if (*ps->p != '"')
+			break;
+		ps->p++;
+		ps->type = T_STRING;
+		return;
+	default:
+		start = ps->p;
+		if (strchr("=!<>", *ps->p))
+			while (*ps->p && strchr("=!<>", *ps->p))
+				ps->p++;
+		else
+			while (*ps->p && !isspace((unsigned char)*ps->p) && !strchr("()\"=!<>", *ps->p))
+				ps->p++;
+		ps->text = strndup(start, ps->p - start);
+		if (!ps->text)
+			break;
+		ps->type = T_WORD;
+		return;
+	}
+	ps->type = T_ERROR;
+}
+
+static int
+is_word(struct parser *ps, const char *word)
+{
+	return ps->type == T_WORD && strcasecmp(ps->text, word) == 0;
+}
+
+/* A LIKE pattern matching value, with '\' as the escape character */
+static char *
+like_pattern(const char *value, const char *before, const char *after)
+{
+	char *pattern, *out;
+
+	pattern = malloc(strlen(before) + 2 * strlen(value) + strlen(after) + 1);
+	if (!pattern)
+		return NULL;
+	out = pattern + sprintf(pattern, "%s", before);
+	for (; *value; value++)
+	{
+		if (*value == '%' || *value == '_' || *value == '\\')
+			*out++ = '\\';
+		*out++ = *value;
+	}
+	strcpy(out, after);
+
+	return pattern;
+}
+
+static char *
+like(const char *column, const char *value, const char *before, const char *after)
+{
+	char *pattern, *sql;
+
+	pattern = like_pattern(value, before, after);
+	if (!pattern)
+		return NULL;
+	sql = sqlite3_mprintf("%s like %Q escape '\\'", column, pattern);
+	free(pattern);
+
+	return sql;
+}
+
+static char *
+title_contains(int fts, const char *value)
+{
+	char *phrase, *out, *sql;
+	const char *p;
+	int chars = 0;
+
+	for (p = value; *p; p++)
+		if ((*p & 0xC0) != 0x80)
+			chars++;
+	if (!fts || chars < FTS_MIN_CHARS)
+		return like("TITLE", value, "%", "%");
+
+	/* an FTS5 string, with '"' doubled */
+	out = phrase = malloc(2 * strlen(value) + 3);
+	if (!phrase)
+		return NULL;
+	*out++ = '"';
+	for (p = value; *p; p++)
+	{
+		if (*p == '"')
+			*out++ = '"';
+		*out++ = *p;
+	}
+	*out++ = '"';
+	*out = '\0';
+	sql = sqlite3_mprintf("ID in (SELECT rowid from OBJECTS_FTS where OBJECTS_FTS match %Q)", phrase);
+	free(phrase);
+
+	return sql;
+}
+
+static char *
+relation(struct parser *ps, const char *name, const char *op, const char *value)
+{
+	const char *column = NULL;
+	enum prop_type type = PROP_TITLE;
+	char *sql = NULL, *cond;
+	int i, relop = 0;
+	long long num;
+	char *end;
+
+	for (i = 0; rel_ops[i]; i++)
+		if (strcmp(op, rel_ops[i]) == 0)
+			relop = 1;
+	if (!relop && strcasecmp(op, "contains") != 0 && strcasecmp(op, "doesNotContain") != 0 &&
+	    strcasecmp(op, "startsWith") != 0 && strcasecmp(op, "derivedfrom") != 0 &&
+	    strcasecmp(op, "exists") != 0)
+		return NULL;
+
+	for (i = 0; properties[i].name; i++)
+	{
+		if (strcmp(name, properties[i].name) == 0)
+		{
+			column = properties[i].column;
+			type = properties[i].type;
+			break;
+		}
+	}
+
+	if (strcasecmp(op, "exists") == 0)
+	{
+		if (strcasecmp(value, "true") != 0 && strcasecmp(value, "false") != 0)
+			return NULL;
+		if (!column)
+			return sqlite3_mprintf("%d", strcasecmp(value, "true") != 0);
+		return sqlite3_mprintf("%s is %snull", column,
+		                       strcasecmp(value, "true") == 0 ? "not " : "");
+	}
+	if (!column)
+		return sqlite3_mprintf("0");
+
+	switch (type)
+	{
+	case PROP_TITLE:
+	case PROP_CLASS:
+		if (relop)
+			sql = sqlite3_mprintf("%s %s %Q", column, op, value);
+		else if (strcasecmp(op, "startsWith") == 0)
+			sql = like(column, value, "", "%");
+		else if (strcasecmp(op, "derivedfrom") == 0)
+		{
+			if (type != PROP_CLASS)
+				break;
+			cond = like(column, value, "", ".%");
+			if (cond)
+				sql = sqlite3_mprintf("(%s = %Q or %s)", column, value, cond);
+			sqlite3_free(cond);
+		}
+		else
+		{
+			if (type == PROP_TITLE)
+				cond = title_contains(ps->fts, value);
+			else
+				cond = like(column, value, "%", "%");
+			if (cond && strcasecmp(op, "doesNotContain") == 0)
+				sql = sqlite3_mprintf("not (%s)", cond);
+			else if (cond)
+				sql = sqlite3_mprintf("%s", cond);
+			sqlite3_free(cond);
+		}
+		break;
+	case PROP_NUMBER:
+		num = strtoll(value, &end, 10);
+		if (relop && *value && !*end)
+			sql = sqlite3_mprintf("%s %s %lld", column, op, num);
+		break;
+	}
+
+	return sql;
+}
+
+static char *parse_or(struct parser *ps);
+
+static char *
+parse_primary(struct parser *ps)
+{
+	char name[64], op[32];
+	char *sql;
+
+	if (ps->type == T_LPAREN)
+	{
+		if (++ps->depth > MAX_DEPTH)
+			return NULL;
+		next_token(ps);
+		sql = parse_or(ps);
+		if (sql && ps->type != T_RPAREN)
+		{
+			sqlite3_free(sql);
+			return NULL;
+		}
+		ps->depth--;
+		next_token(ps);
+		return sql;
+	}
+
+	if (ps->type != T_WORD || strlen(ps->text) >= sizeof(name))
+		return NULL;
+	strcpy(name, ps->text);
+	next_token(ps);
+	if (ps->type != T_WORD || strlen(ps->text) >= sizeof(op))
+		return NULL;
+	strcpy(op, ps->text);
+	next_token(ps);
+	/* exists takes a bare true or false */
+	if (ps->type != (strcasecmp(op, "exists") == 0 ? T_WORD : T_STRING))
+		return NULL;
+	sql = relation(ps, name, op, ps->text);
+	next_token(ps);
+
+	return sql;
+}
+
+static char *
+parse_and(struct parser *ps)
+{
+	char *left, *right, *sql;
+
+	left = parse_primary(ps);
+	while (left && is_word(ps, "and"))
+	{
+		next_token(ps);
+		right = parse_primary(ps);
+		sql = right ? sqlite3_mprintf("(%s and %s)", left, right) : NULL;
+		sqlite3_free(left);
+		sqlite3_free(right);
+		left = sql;
+	}
+
+	return left;
+}
+
+/* "and" binds tighter than "or" */
+static char *
+parse_or(struct parser *ps)
+{
+	char *left, *right, *sql;
+
+	left = parse_and(ps);
+	while (left && is_word(ps, "or"))
+	{
+		next_token(ps);
+		right = parse_and(ps);
+		sql = right ? sqlite3_mprintf("(%s or %s)", left, right) : NULL;
+		sqlite3_free(left);
+		sqlite3_free(right);
+		left = sql;
+	}
+
+	return left;
+}
+
+char *
+search_criteria_sql(const char *criteria, int fts)
+{
+	struct parser ps;
+	char *sql;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.p = criteria;
+	ps.fts = fts;
+	next_token(&ps);
+	if (is_word(&ps, "*"))
+	{
+		next_token(&ps);
+		sql = (ps.type == T_END) ? sqlite3_mprintf("1") : NULL;
+	}
+	else
+	{
+		sql = parse_or(&ps);
+		if (sql && ps.type != T_END)
+		{
+			sqlite3_free(sql);
+			sql = NULL;
+		}
+	}
+	free(ps.text);
+
+	return sql;
+}
@@ -0,0 +1,35 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SEARCH_H__
+#define __SEARCH_H__
+
+/* The properties SearchCriteria may use, for GetSearchCapabilities */
+#define SEARCH_CAPABILITIES	"dc:title,upnp:class,res@size"
+
+/**
+ * Translate UPnP SearchCriteria into an SQL condition on OBJECTS.
+ * "contains" on dc:title goes through the OBJECTS_FTS index when there is
+ * one.  Properties we do not store have no value: comparing them is false,
+ * and so is testing whether they exist.
+ * @param criteria The SearchCriteria, with XML entities decoded.
+ * @param fts Non-zero to use OBJECTS_FTS.
+ * @return The condition, to be freed with sqlite3_free(), or NULL if the
+ *         criteria are invalid.
+ */
+char *search_criteria_sql(const char *criteria, int fts);
+
+#endif // __SEARCH_H__
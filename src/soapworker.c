@@ -0,0 +1,233 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "upnpsoap.h"
+#include "soapworker.h"
+#include "sql.h"
+#include "log.h"
+
+/* The state of a connection whose request is with the workers */
+#define STATE_SOAP	3
+
+struct soap_worker {
+	pthread_t thread;
+	sqlite3 *db;
+};
+
+static struct soap_worker *workers = NULL;
+static int n_workers = 0;
+static pthread_t main_thread;
+static int efd = -1;
+
+/* Requests waiting for a worker, oldest first, linked through soap_next */
+static struct upnphttp *queue_head, *queue_tail;
+static int running = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* Requests answered, newest first.  Workers push onto it without a lock;
+ * the main loop takes the whole list at once, so there is no ABA. */
+static struct upnphttp *done = NULL;
+
+static void
+push_done(struct upnphttp *h)
+{
+	struct upnphttp *head;
+	uint64_t one = 1;
+
+	head = __atomic_load_n(&done, __ATOMIC_RELAXED);
+	do {
+		h->soap_next = head;
+	} while (!__atomic_compare_exchange_n(&done, &head, h, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		DPRINTF(E_ERROR, L_HTTP, "SOAP worker write(eventfd): %s\n", strerror(errno));
+}
+
+static void *
+soap_worker(void *arg)
+{
+	struct soap_worker *w = arg;
+	struct upnphttp *h;
+
+	db = w->db;
+	defer_response = 1;
+
+	pthread_mutex_lock(&lock);
+	while (running)
+	{
+		if (!queue_head)
+		{
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		h = queue_head;
+		queue_head = h->soap_next;
+		if (!queue_head)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&lock);
+
+		ExecuteSoapAction(h, h->req_soapAction, h->req_soapActionLen);
+		push_done(h);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	sql_reader_put(db);
+	db = NULL;
+
+	return NULL;
+}
+
+int
+soap_workers_init(int count)
+{
+	sigset_t set, oldset;
+	int i, ret;
+
+	if (count <= 0)
+		return 0;
+
+	workers = calloc(count, sizeof(struct soap_worker));
+	if (!workers)
+		return 0;
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "SOAP workers eventfd(): %s\n", strerror(errno));
+		free(workers);
+		workers = NULL;
+		return 0;
+	}
+	main_thread = pthread_self();
+	running = 1;
+
+	/* keep signal handling in the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	for (i = 0; i < count; i++)
+	{
+		/* Opened here, so a worker never runs without one */
+		workers[n_workers].db = sql_reader_get();
+		if (!workers[n_workers].db)
+			break;
+		ret = pthread_create(&workers[n_workers].thread, NULL, soap_worker, &workers[n_workers]);
+		if (ret != 0)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "Failed to start SOAP worker: %s\n", strerror(ret));
+			sql_reader_put(workers[n_workers].db);
+			break;
+		}
+		n_workers++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	DPRINTF(E_WARN, L_GENERAL, "Started %d SOAP workers\n", n_workers);
+	if (!n_workers)
+		soap_workers_shutdown();
+
+	return n_workers;
+}
+
+int
+soap_workers_submit(struct upnphttp *h)
+{
+	/* The HTTP workers answer their own */
+	if (!n_workers || !pthread_equal(pthread_self(), main_thread))
+		return -1;
+
+	h->state = STATE_SOAP;
+	h->soap_next = NULL;
+	pthread_mutex_lock(&lock);
+	if (queue_tail)
+		queue_tail->soap_next = h;
+	else
+		queue_head = h;
+	queue_tail = h;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+int
+soap_workers_fd(void)
+{
+	return n_workers ? efd : -1;
+}
+
+void
+soap_workers_complete(void)
+{
+	struct upnphttp *h, *next, *list = NULL;
+	uint64_t n;
+
+	/* Reset the counter before taking the list, so a response pushed
+	 * meanwhile wakes us up again */
+	if (read(efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		DPRINTF(E_ERROR, L_HTTP, "SOAP workers read(eventfd): %s\n", strerror(errno));
+
+	/* Oldest first */
+	for (h = __atomic_exchange_n(&done, NULL, __ATOMIC_ACQUIRE); h; h = next)
+	{
+		next = h->soap_next;
+		h->soap_next = list;
+		list = h;
+	}
+	for (h = list; h; h = next)
+	{
+		next = h->soap_next;
+		h->soap_next = NULL;
+		if (h->res_buflen)
+			SendResp_upnphttp(h);
+		CloseSocket_upnphttp(h);
+	}
+}
+
+void
+soap_workers_shutdown(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < n_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+	n_workers = 0;
+	free(workers);
+	workers = NULL;
+	queue_head = queue_tail = NULL;
+	done = NULL;
+	if (efd >= 0)
+		close(efd);
+	efd = -1;
+}
@@ -0,0 +1,58 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SOAPWORKER_H__
+#define __SOAPWORKER_H__
+
+struct upnphttp;
+
+/**
+ * Start a pool of threads answering the SOAP requests received by the main
+ * loop, each with a read-only database connection of its own, so that SSDP
+ * and new connections are not kept waiting behind a large Browse.  The
+ * responses are built by the workers and sent from the main loop.
+ * @param count The number of workers to start, 0 disables the pool.
+ * @return The number of workers started.
+ */
+int soap_workers_init(int count);
+
+/**
+ * Hand a SOAP request whose body has been received to a worker.  Only
+ * the main thread hands requests over; the connection is left alone until
+ * soap_workers_complete() finishes it.
+ * @return 0 on success, -1 if the caller should execute it itself.
+ */
+int soap_workers_submit(struct upnphttp *h);
+
+/**
+ * @return The descriptor that becomes readable when responses are ready to
+ *         be sent, or -1 if the pool is not running.
+ */
+int soap_workers_fd(void);
+
+/**
+ * Send the responses that are ready and close their connections.  Called
+ * from the main loop when soap_workers_fd() is readable.
+ */
+void soap_workers_complete(void);
+
+/**
+ * Stop all workers, once done with the requests they are executing.  The
+ * connections still waiting are left to be closed with the others.
+ */
+void soap_workers_shutdown(void);
+
+#endif // __SOAPWORKER_H__
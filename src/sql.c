@@ -16,13 +16,38 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "sql.h"
 #include "upnpglobalvars.h"
+#include "scanner.h"
+#include "utils.h"
 #include "log.h"
 
+/* Statements kept prepared, per thread as each has its own connection */
+#define STMT_CACHE_SIZE	32
+
+static __thread struct stmt_cache {
+	sqlite3 *db;
+	unsigned int hash;
+	char *sql;
+	sqlite3_stmt *stmt;
+	unsigned long used;
+} stmt_cache[STMT_CACHE_SIZE];
+static __thread unsigned long stmt_clock;
+
+/* Read-only connections kept open for the next thread that needs one */
+#define READER_POOL_SIZE	8
+
+static sqlite3 *reader_pool[READER_POOL_SIZE];
+static int reader_count;
+static pthread_mutex_t reader_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int
 sql_exec(sqlite3 *db, const char *fmt, ...)
 {
@@ -200,6 +225,282 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	return str;
 }
 
+sqlite3_stmt *
+sql_prepare_cached(sqlite3 *db, const char *sql)
+{
+	struct stmt_cache *c, *victim = stmt_cache;
+	unsigned int hash = DJBHash((uint8_t *)sql, strlen(sql));
+	sqlite3_stmt *stmt;
+	char *copy;
+
+	for (c = stmt_cache; c < stmt_cache + STMT_CACHE_SIZE; c++)
+	{
+		if (c->stmt && c->db == db && c->hash == hash && strcmp(c->sql, sql) == 0)
+		{
+			c->used = ++stmt_clock;
+			sqlite3_reset(c->stmt);
+			sqlite3_clear_bindings(c->stmt);
+			return c->stmt;
+		}
+		if (c->used < victim->used)
+			victim = c;
+	}
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		return NULL;
+	}
+	copy = strdup(sql);
+	if (!copy)
+	{
+		sqlite3_finalize(stmt);
+		return NULL;
+	}
+	if (victim->stmt)
+	{
+		sqlite3_finalize(victim->stmt);
+		free(victim->sql);
+	}
+	victim->db = db;
+	victim->hash = hash;
+	victim->sql = copy;
+	victim->stmt = stmt;
+	victim->used = ++stmt_clock;
+
+	return stmt;
+}
+
+static sqlite3_stmt *
+vbind_cached(sqlite3 *db, const char *sql, const char *types, va_list ap)
+{
+	sqlite3_stmt *stmt;
+	const char *str;
+	int i, ret = SQLITE_OK;
+
+	stmt = sql_prepare_cached(db, sql);
+	if (!stmt)
+		return NULL;
+	if (strlen(types) != sqlite3_bind_parameter_count(stmt))
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "%d parameters, %d bound\n%s\n",
+		        sqlite3_bind_parameter_count(stmt), (int)strlen(types), sql);
+		return NULL;
+	}
+	for (i = 1; *types && ret == SQLITE_OK; types++, i++)
+	{
+		switch (*types)
+		{
+			case 'i':
+				ret = sqlite3_bind_int(stmt, i, va_arg(ap, int));
+				break;
+			case 'I':
+				ret = sqlite3_bind_int64(stmt, i, va_arg(ap, int64_t));
+				break;
+			case 't':
+				str = va_arg(ap, const char *);
+				if (!str)
+					ret = sqlite3_bind_null(stmt, i);
+				else	/* the caller's string outlives the statement's use */
+					ret = sqlite3_bind_text(stmt, i, str, -1, SQLITE_STATIC);
+				break;
+			default:
+				ret = SQLITE_MISUSE;
+				break;
+		}
+	}
+	if (ret != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "bind %d failed: %s\n%s\n", i - 1, sqlite3_errstr(ret), sql);
+		return NULL;
+	}
+
+	return stmt;
+}
+
+sqlite3_stmt *
+sql_bind_cached(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+
+	va_start(ap, types);
+	stmt = vbind_cached(db, sql, types, ap);
+	va_end(ap);
+
+	return stmt;
+}
+
+/* Step, retrying a few times while the database is locked */
+static int
+step(sqlite3_stmt *stmt)
+{
+	int counter, result;
+
+	for (counter = 0;
+	     ((result = sqlite3_step(stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
+	     counter++)
+	{
+		/* While SQLITE_BUSY has a built in timeout,
+		 * SQLITE_LOCKED does not, so sleep */
+		if (result == SQLITE_LOCKED)
+			sleep(1);
+	}
+
+	return result;
+}
+
+int
+sql_exec_cached(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int ret;
+
+	va_start(ap, types);
+	stmt = vbind_cached(db, sql, types, ap);
+	va_end(ap);
+	if (!stmt)
+		return SQLITE_ERROR;
+
+	while ((ret = step(stmt)) == SQLITE_ROW)
+		;
+	if (ret != SQLITE_DONE)
+		DPRINTF(E_ERROR, L_DB_SQL, "SQL ERROR %d [%s]\n%s\n", ret, sqlite3_errmsg(db), sql);
+	sqlite3_reset(stmt);
+
+	return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+int64_t
+sql_get_int_cached(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	int64_t ret;
+
+	va_start(ap, types);
+	stmt = vbind_cached(db, sql, types, ap);
+	va_end(ap);
+	if (!stmt)
+		return -1;
+
+	switch (step(stmt))
+	{
+		case SQLITE_DONE:
+			/* no rows returned */
+			ret = 0;
+			break;
+		case SQLITE_ROW:
+			ret = sqlite3_column_int64(stmt, 0);
+			break;
+		default:
+			DPRINTF(E_WARN, L_DB_SQL, "%s: step failed: %s\n%s\n", __func__, sqlite3_errmsg(db), sql);
+			ret = -1;
+			break;
+	}
+	sqlite3_reset(stmt);
+
+	return ret;
+}
+
+char *
+sql_get_text_cached(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	sqlite3_stmt *stmt;
+	va_list ap;
+	char *str = NULL;
+
+	va_start(ap, types);
+	stmt = vbind_cached(db, sql, types, ap);
+	va_end(ap);
+	if (!stmt)
+		return NULL;
+
+	switch (step(stmt))
+	{
+		case SQLITE_DONE:
+			/* no rows returned */
+			break;
+		case SQLITE_ROW:
+			if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+				str = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+			break;
+		default:
+			DPRINTF(E_WARN, L_DB_SQL, "SQL step failed: %s\n", sqlite3_errmsg(db));
+			break;
+	}
+	sqlite3_reset(stmt);
+
+	return str;
+}
+
+void
+sql_finalize_cached(sqlite3 *db)
+{
+	struct stmt_cache *c;
+
+	for (c = stmt_cache; c < stmt_cache + STMT_CACHE_SIZE; c++)
+	{
+		if (!c->stmt || c->db != db)
+			continue;
+		sqlite3_finalize(c->stmt);
+		free(c->sql);
+		memset(c, 0, sizeof(*c));
+	}
+}
+
+sqlite3 *
+sql_reader_get(void)
+{
+	char path[PATH_MAX];
+	sqlite3 *db = NULL;
+
+	pthread_mutex_lock(&reader_lock);
+	if (reader_count)
+		db = reader_pool[--reader_count];
+	pthread_mutex_unlock(&reader_lock);
+	if (db)
+		return db;
+
+	snprintf(path, sizeof(path), "%s/files.db", db_path);
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "Failed to open %s: %s\n", path, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+	sqlite3_busy_timeout(db, 5000);
+
+	return db;
+}
+
+void
+sql_reader_put(sqlite3 *db)
+{
+	if (!db)
+		return;
+	sql_finalize_cached(db);
+	pthread_mutex_lock(&reader_lock);
+	if (reader_count < READER_POOL_SIZE)
+	{
+		reader_pool[reader_count++] = db;
+		db = NULL;
+	}
+	pthread_mutex_unlock(&reader_lock);
+	if (db)
+		sqlite3_close(db);
+}
+
+void
+sql_reader_close_all(void)
+{
+	pthread_mutex_lock(&reader_lock);
+	while (reader_count)
+		sqlite3_close(reader_pool[--reader_count]);
+	pthread_mutex_unlock(&reader_lock);
+}
+
 int
 db_upgrade(sqlite3 *db)
 {
@@ -223,6 +524,75 @@ db_upgrade(sqlite3 *db)
 	{
 		return 10;
 	}
+	/* v12 only added indexes, which the v13 table is created with */
+	if (db_vers < 13)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 13);
+		if (UpgradeObjectKeys(db) != SQLITE_OK)
+			return db_vers;
+	}
+	if (db_vers < 14)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 14);
+		/* Older tables were rebuilt with the new columns above */
+		if (db_vers == 13 &&
+		    (sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN CHILD_COUNT INTEGER") != SQLITE_OK ||
+		     sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN STORAGE_USED INTEGER") != SQLITE_OK))
+			return 13;
+		if (CountContainerTotals(db) != SQLITE_OK)
+			return db_vers;
+	}
+	if (db_vers < 15)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 15);
+		if (CreateSearchIndex(db) != SQLITE_OK)
+			return db_vers;
+	}
+	if (db_vers < 16)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 16);
+		/* The title index gained IDX, the others are new */
+		if (sql_exec(db, "DROP INDEX IF EXISTS IDX_OBJECTS_PARENT_TITLE") != SQLITE_OK ||
+		    CreateIndexes(db) != SQLITE_OK)
+			return db_vers;
+	}
+	if (db_vers < 17)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 17);
+		/* Titles are now stored as they are and escaped when written
+		 * out.  "&amp;" goes last, so text that only looked like an
+		 * entity comes out as it was. */
+		if (sql_exec(db, "UPDATE OBJECTS set TITLE = "
+		                 "replace(replace(replace(replace(TITLE, '&amp;lt;', '<'), "
+		                 "'&amp;gt;', '>'), '&amp;quot;', '\"'), '&amp;amp;', '&') "
+		                 "where TITLE like '%%&amp;%%'") != SQLITE_OK)
+			return db_vers;
+	}
+	if (db_vers < 18)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 18);
+		/* Fragments are rendered by UpdateFragments() */
+		if ((db_vers >= 13 &&
+		     sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN DIDL TEXT") != SQLITE_OK) ||
+		    CreateSettings(db) != SQLITE_OK)
+			return db_vers;
+	}
+	if (db_vers < 19)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 19);
+		/* Containers start out as changed under the first updateID */
+		if ((db_vers >= 13 &&
+		     sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN UPDATE_ID INTEGER") != SQLITE_OK) ||
+		    sql_exec(db, "UPDATE OBJECTS set UPDATE_ID = 1 "
+		                 "where CLASS like 'container%%' and UPDATE_ID is NULL") != SQLITE_OK ||
+		    CreateIndexes(db) != SQLITE_OK)
+			return db_vers;
+	}
+	/* The steps above rewrite rows in place, which the catalog does not
+	 * notice.  This goes before the version, so it is not missed if we
+	 * stop in between. */
+	if (sql_exec(db, "DELETE from SETTINGS where KEY = 'CATALOG'") != SQLITE_OK)
+		return db_vers;
 	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
 	return 0;
@@ -38,6 +38,72 @@ int sql_exec(sqlite3 *db, const char *fmt, ...);
 int sql_get_table(sqlite3 *db, const char *zSql, char ***pazResult, int *pnRow, int *pnColumn);
 int sql_get_int_field(sqlite3 *db, const char *fmt, ...);
 char * sql_get_text_field(sqlite3 *db, const char *fmt, ...);
+
+/**
+ * Get a statement prepared on db the first time this thread asks for its
+ * SQL, and kept until it is among the least recently used.  Parameters are
+ * bound with the sqlite3_bind_*() functions; it comes reset, with none
+ * bound.  Reset it once done, so it does not hold a read transaction.
+ * @return The statement, which must not be finalized, or NULL on error.
+ */
+sqlite3_stmt * sql_prepare_cached(sqlite3 *db, const char *sql);
+
+/**
+ * Get a statement as sql_prepare_cached() does, with arguments bound to its
+ * parameters in order.  types has a character for each:
+ *   'i' int, 'I' int64_t, 't' const char *, where a NULL one binds NULL
+ * Strings are not copied, so must outlive the statement's use.
+ * @return The statement, or NULL on error.
+ */
+sqlite3_stmt * sql_bind_cached(sqlite3 *db, const char *sql, const char *types, ...);
+
+/* The helpers below take a statement as sql_bind_cached() does, and reset it
+ * once done. */
+
+/**
+ * Run a statement to completion.
+ * @return SQLITE_OK, or the error.
+ */
+int sql_exec_cached(sqlite3 *db, const char *sql, const char *types, ...);
+
+/**
+ * @return The first column of the first row, 0 if there is none or it is
+ *         NULL, -1 on error, as sql_get_int_field().
+ */
+int64_t sql_get_int_cached(sqlite3 *db, const char *sql, const char *types, ...);
+
+/**
+ * @return The first column of the first row, to be freed with
+ *         sqlite3_free(), or NULL, as sql_get_text_field().
+ */
+char * sql_get_text_cached(sqlite3 *db, const char *sql, const char *types, ...);
+
+/**
+ * Finalize the statements this thread prepared on db, before closing it.
+ */
+void sql_finalize_cached(sqlite3 *db);
+
+/* The database is in WAL mode: one connection writes, and any number of
+ * read-only ones read from a snapshot of the last commit, without waiting
+ * for the writer.  Threads other than the main one take a read-only
+ * connection from a small pool. */
+
+/**
+ * Take a read-only connection from the pool, opening one if it is empty.
+ * @return The connection, or NULL on error.
+ */
+sqlite3 * sql_reader_get(void);
+
+/**
+ * Hand a connection back to the pool once done with it, finalizing the
+ * statements this thread prepared on it.
+ */
+void sql_reader_put(sqlite3 *db);
+
+/**
+ * Close the connections in the pool, at shutdown.
+ */
+void sql_reader_close_all(void);
 int db_upgrade(sqlite3 *db);
 
 #endif
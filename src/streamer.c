@@ -0,0 +1,425 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "upnpglobalvars.h"
+#include "streamer.h"
+#include "restart.h"
+#include "utils.h"
+#include "log.h"
+#include "sendfile.h"
+
+/* Bytes sent per sendfile() call, so one fast client can't starve the
+ * others sharing a worker */
+#define STREAM_CHUNK	(1024 * 1024)
+
+struct stream_job {
+	off_t offset;
+	off_t end;
+};
+
+struct stream_worker {
+	volatile pid_t pid;
+	int ctl;
+	int active;
+	time_t started;
+};
+
+struct transfer {
+	int sock;
+	int fd;
+	off_t offset;
+	off_t end;
+};
+
+static struct stream_worker *workers = NULL;
+static int n_workers = 0;
+static int max_per_worker = 0;
+static volatile sig_atomic_t worker_died = 0;
+static int stopping = 0;
+/* submissions may come from several HTTP worker threads */
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+worker_report(int ctl, int active)
+{
+	/* Only the latest count matters, so a dropped message is harmless */
+	send(ctl, &active, sizeof(active), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void
+worker_loop(int ctl)
+{
+	struct transfer *xfers = NULL;
+	struct pollfd *pfds = NULL;
+	int n = 0, alloced = 0;
+	int accepting = 1;
+	int i;
+
+	while (!quitting && (accepting || n))
+	{
+		pfds = realloc(pfds, sizeof(struct pollfd) * (n + 1));
+		if (!pfds)
+			break;
+		pfds[0].fd = accepting ? ctl : -1;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		for (i = 0; i < n; i++)
+		{
+			pfds[i+1].fd = xfers[i].sock;
+			pfds[i+1].events = POLLOUT;
+			pfds[i+1].revents = 0;
+		}
+		if (poll(pfds, n + 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			DPRINTF(E_ERROR, L_HTTP, "streamer poll(): %s\n", strerror(errno));
+			break;
+		}
+
+		/* Walk backwards so finished transfers can be swapped out */
+		for (i = n - 1; i >= 0; i--)
+		{
+			struct transfer *x = &xfers[i];
+			off_t len;
+			ssize_t ret;
+
+			if (!pfds[i+1].revents)
+				continue;
+			ret = 0;
+			if (!(pfds[i+1].revents & (POLLERR|POLLHUP|POLLNVAL)))
+			{
+				len = x->end - x->offset + 1;
+				if (len > STREAM_CHUNK)
+					len = STREAM_CHUNK;
+				ret = sys_sendfile(x->sock, x->fd, &x->offset, len);
+				if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+					continue;
+				if (ret < 0)
+					DPRINTF(E_DEBUG, L_HTTP, "sendfile error :: error no. %d [%s]\n",
+						errno, strerror(errno));
+				else if (ret > 0 && x->offset <= x->end)
+					continue;
+			}
+			close(x->sock);
+			close(x->fd);
+			xfers[i] = xfers[--n];
+			worker_report(ctl, n);
+		}
+
+		if (pfds[0].revents & POLLIN)
+		{
+			struct stream_job job;
+			int fds[UTILS_MAX_FDS];
+			int nfds;
+			ssize_t len;
+
+			len = recv_fds(ctl, &job, sizeof(job), fds, &nfds);
+			if (len == sizeof(job) && nfds == 2)
+			{
+				if (n == alloced)
+				{
+					struct transfer *tmp;
+					tmp = realloc(xfers, sizeof(struct transfer) * (alloced + 16));
+					if (!tmp)
+					{
+						close(fds[0]);
+						close(fds[1]);
+						worker_report(ctl, n);
+						continue;
+					}
+					xfers = tmp;
+					alloced += 16;
+				}
+				fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+				xfers[n].sock = fds[0];
+				xfers[n].fd = fds[1];
+				xfers[n].offset = job.offset;
+				xfers[n].end = job.end;
+				n++;
+			}
+			else if (len == sizeof(job) && nfds == 1)
+			{
+				/* Hot restart: pass our transfers on to the new
+				 * instance and leave */
+				for (i = 0; i < n; i++)
+				{
+					if (restart_send_stream(fds[0], xfers[i].sock, xfers[i].fd,
+					                        xfers[i].offset, xfers[i].end) != 0)
+						DPRINTF(E_ERROR, L_HTTP, "Could not hand over transfer: %s\n",
+							strerror(errno));
+					close(xfers[i].sock);
+					close(xfers[i].fd);
+				}
+				close(fds[0]);
+				n = 0;
+				accepting = 0;
+			}
+			else
+			{
+				for (i = 0; i < nfds; i++)
+					close(fds[i]);
+				/* The parent went away; finish what we have */
+				if (len == 0 || (len < 0 && errno != EAGAIN))
+					accepting = 0;
+			}
+		}
+		else if (pfds[0].revents & (POLLERR|POLLHUP))
+			accepting = 0;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		close(xfers[i].sock);
+		close(xfers[i].fd);
+	}
+	free(xfers);
+	free(pfds);
+}
+
+static int
+spawn_worker(struct stream_worker *w)
+{
+	int sv[2];
+	pid_t pid;
+	int i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "streamer socketpair(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "streamer fork(): %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0)
+	{
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGUSR1, SIG_IGN);
+		signal(SIGCHLD, SIG_DFL);
+		close(sv[0]);
+		for (i = 0; i < n_workers; i++)
+		{
+			if (workers[i].ctl >= 0)
+				close(workers[i].ctl);
+		}
+		worker_loop(sv[1]);
+		_exit(0);
+	}
+
+	close(sv[1]);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	w->ctl = sv[0];
+	w->active = 0;
+	w->started = time(NULL);
+	w->pid = pid;
+	DPRINTF(E_DEBUG, L_GENERAL, "Started streaming worker %d\n", (int)pid);
+
+	return 0;
+}
+
+static void
+drain_worker(struct stream_worker *w)
+{
+	int active;
+
+	while (recv(w->ctl, &active, sizeof(active), MSG_DONTWAIT) == sizeof(active))
+		w->active = active;
+}
+
+int
+streamer_init(int count)
+{
+	int i, started = 0;
+
+	if (count <= 0)
+		return 0;
+
+	workers = calloc(count, sizeof(struct stream_worker));
+	if (!workers)
+		return 0;
+	for (i = 0; i < count; i++)
+		workers[i].ctl = -1;
+	n_workers = count;
+	max_per_worker = (runtime_vars.max_connections + count - 1) / count;
+
+	for (i = 0; i < count; i++)
+	{
+		if (spawn_worker(&workers[i]) == 0)
+			started++;
+	}
+	DPRINTF(E_WARN, L_GENERAL, "Started %d streaming workers\n", started);
+
+	return started;
+}
+
+int
+streamer_enabled(void)
+{
+	return n_workers > 0;
+}
+
+int
+streamer_submit(int sock, int fd, off_t offset, off_t end)
+{
+	struct stream_worker *best = NULL;
+	struct stream_job job;
+	int fds[2];
+	int ret = -1;
+	int i;
+
+	pthread_mutex_lock(&submit_lock);
+	for (i = 0; i < n_workers; i++)
+	{
+		struct stream_worker *w = &workers[i];
+
+		if (!w->pid || w->ctl < 0)
+			continue;
+		drain_worker(w);
+		if (w->active >= max_per_worker)
+			continue;
+		if (!best || w->active < best->active)
+			best = w;
+	}
+	if (!best)
+	{
+		DPRINTF(E_WARN, L_HTTP, "No streaming worker available\n");
+		goto out;
+	}
+
+	job.offset = offset;
+	job.end = end;
+	fds[0] = sock;
+	fds[1] = fd;
+	if (send_fds(best->ctl, &job, sizeof(job), fds, 2) != 0)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Handing transfer to worker %d failed: %s\n",
+			(int)best->pid, strerror(errno));
+		goto out;
+	}
+	best->active++;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&submit_lock);
+
+	return ret;
+}
+
+int
+streamer_child_exited(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < n_workers; i++)
+	{
+		if (workers[i].pid != pid)
+			continue;
+		workers[i].pid = 0;
+		worker_died = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+streamer_maintain(void)
+{
+	time_t now;
+	int i;
+
+	if (!worker_died || stopping)
+		return;
+	worker_died = 0;
+	now = time(NULL);
+
+	for (i = 0; i < n_workers; i++)
+	{
+		struct stream_worker *w = &workers[i];
+
+		if (w->pid)
+			continue;
+		if (w->ctl >= 0)
+		{
+			drain_worker(w);
+			DPRINTF(E_ERROR, L_GENERAL, "Streaming worker died with %d transfers\n", w->active);
+			close(w->ctl);
+			w->ctl = -1;
+		}
+		/* Don't spin if a worker keeps dying right after startup */
+		if (now - w->started < 1 || spawn_worker(w) != 0)
+			worker_died = 1;
+	}
+}
+
+void
+streamer_handoff(int s)
+{
+	struct stream_job job;
+	int i;
+
+	stopping = 1;
+	memset(&job, 0, sizeof(job));
+	for (i = 0; i < n_workers; i++)
+	{
+		if (workers[i].ctl < 0)
+			continue;
+		if (workers[i].pid && send_fds(workers[i].ctl, &job, sizeof(job), &s, 1) != 0)
+			DPRINTF(E_ERROR, L_GENERAL, "Could not hand over worker %d: %s\n",
+				(int)workers[i].pid, strerror(errno));
+		close(workers[i].ctl);
+		workers[i].ctl = -1;
+	}
+}
+
+void
+streamer_shutdown(void)
+{
+	int i;
+
+	stopping = 1;
+	for (i = 0; i < n_workers; i++)
+	{
+		if (workers[i].pid)
+			kill(workers[i].pid, SIGTERM);
+		if (workers[i].ctl >= 0)
+			close(workers[i].ctl);
+		workers[i].ctl = -1;
+	}
+	/* The array stays around so SIGCHLD can still tell workers apart */
+}
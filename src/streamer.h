@@ -0,0 +1,72 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __STREAMER_H__
+#define __STREAMER_H__
+
+#include <sys/types.h>
+
+/**
+ * Start a pool of pre-forked streaming workers.  Once the response headers
+ * have been sent, the HTTP socket and the opened media file are handed to a
+ * worker, which multiplexes the body transfers of many clients.
+ * @param count The number of workers to start, 0 disables the pool.
+ * @return The number of workers started.
+ */
+int streamer_init(int count);
+
+/**
+ * @return Non-zero if the pool is running and can take transfers.
+ */
+int streamer_enabled(void);
+
+/**
+ * Hand a transfer to the least loaded worker.  On success the worker owns
+ * its own copies of both descriptors and the caller should close its ones.
+ * @param sock The connected HTTP socket.
+ * @param fd The opened media file.
+ * @param offset The first byte to send.
+ * @param end The last byte to send.
+ * @return 0 on success, -1 if no worker could take the transfer.
+ */
+int streamer_submit(int sock, int fd, off_t offset, off_t end);
+
+/**
+ * To be called from the SIGCHLD handler.
+ * @param pid The pid of the child that terminated.
+ * @return 1 if it was a streaming worker, 0 otherwise.
+ */
+int streamer_child_exited(pid_t pid);
+
+/**
+ * Collect transfer completions and restart workers that died.  Called
+ * from the main loop.
+ */
+void streamer_maintain(void);
+
+/**
+ * Hot restart: have every worker pass its transfers on to the new
+ * instance over the handoff socket, then exit.
+ * @param s The handoff socket.
+ */
+void streamer_handoff(int s);
+
+/**
+ * Stop all workers.
+ */
+void streamer_shutdown(void);
+
+#endif // __STREAMER_H__
@@ -35,6 +35,7 @@
 #include "upnpdescgen.h"
 #include "minidlnapath.h"
 #include "upnpglobalvars.h"
+#include "upnpevents.h"
 
 #undef DESC_DEBUG
 
@@ -287,6 +288,7 @@ static const struct stateVar ContentDirectoryVars[] =
 	{"SearchCapabilities", 0, 0},
 	{"SortCapabilities", 0, 0},
 	{"SystemUpdateID", 3|EVENTED, 0, 0, 255},
+	{"ContainerUpdateIDs", 0|EVENTED, 0, 0, 255},
 	{0, 0}
 };
 
@@ -580,3 +582,64 @@ genConnectionManager(int * len)
 {
 	return genServiceDesc(len, &scpdConnectionManager);
 }
+
+/* genEventVars() :
+ * Generate the property set sent to event subscribers, with the current
+ * value of each evented variable. */
+static char *
+genEventVars(int * len, const struct serviceDesc * s)
+{
+	const struct stateVar * v;
+	char * str;
+	int tmplen;
+	char buf[512];
+
+	tmplen = 512;
+	str = (char *)malloc(tmplen);
+	if(str == NULL)
+		return NULL;
+	*len = 0;
+	str[0] = '\0';
+	str = strcat_str(str, len, &tmplen,
+		"<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">");
+	for(v = s->serviceStateTable; v->name; v++)
+	{
+		if(!(v->itype & EVENTED))
+			continue;
+		snprintf(buf, sizeof(buf), "<e:property><%s>", v->name);
+		str = strcat_str(str, len, &tmplen, buf);
+		switch(v->ieventvalue)
+		{
+		case 0:
+			break;
+		case 255:	/* Magical values should go around here */
+			if(strcmp(v->name, "SystemUpdateID") == 0)
+			{
+				snprintf(buf, sizeof(buf), "%u", updateID);
+				str = strcat_str(str, len, &tmplen, buf);
+			}
+			else if(strcmp(v->name, "ContainerUpdateIDs") == 0)
+				str = strcat_str(str, len, &tmplen, upnp_event_container_update_ids());
+			break;
+		default:
+			str = strcat_str(str, len, &tmplen, upnpallowedvalues[v->ieventvalue]);
+		}
+		snprintf(buf, sizeof(buf), "</%s></e:property>", v->name);
+		str = strcat_str(str, len, &tmplen, buf);
+	}
+	str = strcat_str(str, len, &tmplen, "</e:propertyset>");
+	str[*len] = '\0';
+	return str;
+}
+
+char *
+getVarsContentDirectory(int * len)
+{
+	return genEventVars(len, &scpdContentDirectory);
+}
+
+char *
+getVarsConnectionManager(int * len)
+{
+	return genEventVars(len, &scpdConnectionManager);
+}
@@ -82,5 +82,12 @@ genContentDirectory(int * len);
 char *
 genConnectionManager(int * len);
 
+/* the property sets sent to event subscribers */
+char *
+getVarsContentDirectory(int * len);
+
+char *
+getVarsConnectionManager(int * len);
+
 #endif
 
@@ -0,0 +1,688 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+
+#include "upnpglobalvars.h"
+#include "upnpdescgen.h"
+#include "upnpevents.h"
+#include "objectid.h"
+#include "sql.h"
+#include "log.h"
+
+#define SUBSCRIBE_TIMEOUT	300	/* seconds, when the subscriber does not ask */
+#define SUBSCRIBE_TIMEOUT_MAX	1800
+#define MAX_SUBSCRIBERS		64
+#define NOTIFY_TIMEOUT		30	/* seconds a NOTIFY may take */
+#define CONTAINER_UPDATE_IDS_LEN	4096
+
+struct subscriber {
+	LIST_ENTRY(subscriber) entries;
+	enum subscriber_service_enum service;
+	time_t expires;
+	uint32_t seq;		/* SEQ of the next event */
+	int pending;		/* an event is due */
+	int sending;		/* one is on its way, the next must wait */
+	struct sockaddr_in addr;	/* of the callback */
+	char sid[SID_LEN];
+	char path[];		/* of the callback */
+};
+
+enum notify_state {
+	ECreated = 1,
+	EConnecting,
+	ESending,
+	EWaitingForResponse,
+	EFinished,
+	EError
+};
+
+struct upnp_event_notify {
+	LIST_ENTRY(upnp_event_notify) entries;
+	int s;
+	enum notify_state state;
+	time_t deadline;
+	struct sockaddr_in addr;
+	char sid[SID_LEN];
+	char *buffer;
+	int tosend;
+	int sent;
+};
+
+/* The subscriptions, and what goes with them, are under the lock */
+static LIST_HEAD(, subscriber) subscriberlist = LIST_HEAD_INITIALIZER(subscriberlist);
+static int n_subscribers = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether each service has changed since its last events, sent when */
+static struct {
+	int changed;
+	time_t last;
+} services[EConnectionManager + 1];
+
+/* Wakes the main loop up for the initial event of a subscription made in
+ * another thread.  Only the main loop opens and closes it. */
+static int efd = -1;
+
+/* The NOTIFYs on their way, which only the main loop looks at */
+static LIST_HEAD(, upnp_event_notify) notifylist = LIST_HEAD_INITIALIZER(notifylist);
+
+/* ContainerUpdateIDs as last evented, and the updateID it goes up to.
+ * What changed before the main loop started is not for events. */
+static char container_update_ids[CONTAINER_UPDATE_IDS_LEN];
+static uint32_t evented_update_id = 0;
+static int evented_started = 0;
+
+static int
+grant_timeout(int timeout)
+{
+	if (timeout <= 0)
+		return SUBSCRIBE_TIMEOUT;
+	return MIN(timeout, SUBSCRIBE_TIMEOUT_MAX);
+}
+
+/* Split "http://a.b.c.d[:port][/path]".  Hosts by name are not looked up. */
+static int
+parse_callback(const char *callback, int len, struct sockaddr_in *addr,
+               const char **path, int *pathlen)
+{
+	const char *p, *end = callback + len;
+	char host[INET_ADDRSTRLEN];
+	int n = 0, port = 80;
+
+	if (len < 7 || strncasecmp(callback, "http://", 7) != 0)
+		return -1;
+	for (p = callback + 7; p < end && *p != ':' && *p != '/'; p++)
+	{
+		if (n >= sizeof(host) - 1)
+			return -1;
+		host[n++] = *p;
+	}
+	host[n] = '\0';
+	if (p < end && *p == ':')
+	{
+		for (port = 0, p++; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			port = port * 10 + (*p - '0');
+			if (port > 65535)
+				return -1;
+		}
+		if (!port)
+			return -1;
+	}
+	if (p < end && *p != '/')
+		return -1;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &addr->sin_addr) != 1)
+		return -1;
+	if (p == end)
+	{
+		*path = "/";
+		*pathlen = 1;
+		return 0;
+	}
+	/* it goes into the request line */
+	for (*path = p; p < end; p++)
+	{
+		if ((unsigned char)*p <= ' ')
+			return -1;
+	}
+	*pathlen = end - *path;
+
+	return 0;
+}
+
+static void
+make_sid(char sid[SID_LEN])
+{
+	unsigned char r[16];
+	int i;
+
+	if (getrandom(r, sizeof(r), 0) != sizeof(r))
+	{
+		for (i = 0; i < sizeof(r); i++)
+			r[i] = random();
+	}
+	/* a version 4 UUID */
+	r[6] = (r[6] & 0x0f) | 0x40;
+	r[8] = (r[8] & 0x3f) | 0x80;
+	snprintf(sid, SID_LEN, "uuid:%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+	         "%02x%02x%02x%02x%02x%02x", r[0], r[1], r[2], r[3], r[4], r[5],
+	         r[6], r[7], r[8], r[9], r[10], r[11], r[12], r[13], r[14], r[15]);
+}
+
+/* With the lock held */
+static struct subscriber *
+find_subscriber(enum subscriber_service_enum service, const char *sid, int sidlen)
+{
+	struct subscriber *sub;
+
+	for (sub = subscriberlist.lh_first; sub; sub = sub->entries.le_next)
+	{
+		if (sub->service == service && strlen(sub->sid) == sidlen &&
+		    strncmp(sub->sid, sid, sidlen) == 0)
+			return sub;
+	}
+
+	return NULL;
+}
+
+void
+upnp_event_var_change_notify(enum subscriber_service_enum service)
+{
+	pthread_mutex_lock(&lock);
+	services[service].changed = 1;
+	pthread_mutex_unlock(&lock);
+}
+
+/* List the containers changed since the last ContentDirectory event, as
+ * ObjectID,UpdateID pairs.  If they do not fit, the root is listed alone,
+ * which tells the subscribers to look at everything again. */
+static void
+update_container_ids(void)
+{
+	sqlite3_stmt *stmt;
+	char id[OBJECT_ID_LEN];
+	uint32_t current = updateID;
+	size_t len = 0;
+	int n, ret;
+
+	container_update_ids[0] = '\0';
+	/* A pair takes four characters at least, so one row more than fit
+	 * in that many is as far as we need to look */
+	stmt = sql_bind_cached(db, "SELECT ID, UPDATE_ID from OBJECTS "
+	                           "where UPDATE_ID > ? and UPDATE_ID <= ? limit ?",
+	                       "IIi", (int64_t)evented_update_id, (int64_t)current,
+	                       CONTAINER_UPDATE_IDS_LEN / 4 + 1);
+	if (!stmt)
+		return;
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if (object_id_from_key(db, sqlite3_column_int64(stmt, 0), id, sizeof(id)) != 0)
+			continue;
+		n = snprintf(container_update_ids + len, sizeof(container_update_ids) - len, "%s%s,%u",
+		             len ? "," : "", id, (uint32_t)sqlite3_column_int64(stmt, 1));
+		if (n >= (int)(sizeof(container_update_ids) - len))
+			break;
+		len += n;
+	}
+	sqlite3_reset(stmt);
+	if (ret == SQLITE_ROW)
+	{
+		ret = sql_get_int_cached(db, "SELECT UPDATE_ID from OBJECTS where PARENT = 0", "");
+		snprintf(container_update_ids, sizeof(container_update_ids), "0,%u",
+		         ret > 0 ? (uint32_t)ret : current);
+	}
+	else if (ret != SQLITE_DONE)
+		DPRINTF(E_ERROR, L_HTTP, "Failed to list the changed containers: %s\n", sqlite3_errmsg(db));
+	evented_update_id = current;
+}
+
+const char *
+upnp_event_container_update_ids(void)
+{
+	return container_update_ids;
+}
+
+int
+upnpevents_addSubscriber(enum subscriber_service_enum service,
+                         const char *callback, int callbacklen,
+                         struct in_addr client, int *timeout, char sid[SID_LEN])
+{
+	struct subscriber *sub;
+	struct sockaddr_in addr;
+	char host[INET_ADDRSTRLEN];
+	const char *path;
+	uint64_t one = 1;
+	int pathlen;
+	int ret = 0;
+
+	inet_ntop(AF_INET, &client, host, sizeof(host));
+	/* or anyone could have us send events to a third party */
+	if (parse_callback(callback, callbacklen, &addr, &path, &pathlen) != 0 ||
+	    addr.sin_addr.s_addr != client.s_addr)
+	{
+		DPRINTF(E_WARN, L_HTTP, "Refusing event callback <%.*s> from %s\n",
+		        callbacklen, callback, host);
+		return -1;
+	}
+	sub = calloc(1, sizeof(struct subscriber) + pathlen + 1);
+	if (!sub)
+		return -2;
+	sub->service = service;
+	sub->addr = addr;
+	memcpy(sub->path, path, pathlen);
+	make_sid(sub->sid);
+	/* the initial event, with every evented variable */
+	sub->pending = 1;
+	*timeout = grant_timeout(*timeout);
+	sub->expires = time(NULL) + *timeout;
+	strcpy(sid, sub->sid);
+
+	pthread_mutex_lock(&lock);
+	if (n_subscribers < MAX_SUBSCRIBERS)
+	{
+		LIST_INSERT_HEAD(&subscriberlist, sub, entries);
+		n_subscribers++;
+		if (efd >= 0 && write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			DPRINTF(E_ERROR, L_HTTP, "Events write(eventfd): %s\n", strerror(errno));
+	}
+	else
+		ret = -2;
+	pthread_mutex_unlock(&lock);
+
+	if (ret)
+	{
+		DPRINTF(E_WARN, L_HTTP, "Too many event subscriptions, refusing %s\n", host);
+		free(sub);
+		return ret;
+	}
+	DPRINTF(E_DEBUG, L_HTTP, "Subscribed %s for %d seconds\n", sid, *timeout);
+
+	return 0;
+}
+
+int
+upnpevents_renewSubscription(enum subscriber_service_enum service,
+                             const char *sid, int sidlen, int *timeout)
+{
+	struct subscriber *sub;
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+	sub = find_subscriber(service, sid, sidlen);
+	if (sub)
+	{
+		*timeout = grant_timeout(*timeout);
+		sub->expires = time(NULL) + *timeout;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+int
+upnpevents_removeSubscriber(enum subscriber_service_enum service,
+                            const char *sid, int sidlen)
+{
+	struct subscriber *sub;
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+	sub = find_subscriber(service, sid, sidlen);
+	if (sub)
+	{
+		LIST_REMOVE(sub, entries);
+		n_subscribers--;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	/* a NOTIFY on its way goes on without it */
+	free(sub);
+
+	return ret;
+}
+
+int
+upnpevents_subscribers(void)
+{
+	int n;
+
+	pthread_mutex_lock(&lock);
+	n = n_subscribers;
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
+/* Queue the next event of a subscriber, with the lock held */
+static void
+upnp_event_create_notify(struct subscriber *sub, time_t now)
+{
+	static const char notifyhead[] =
+		"NOTIFY %s HTTP/1.1\r\n"
+		"HOST: %s:%d\r\n"
+		"CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+		"CONTENT-LENGTH: %d\r\n"
+		"NT: upnp:event\r\n"
+		"NTS: upnp:propchange\r\n"
+		"SID: %s\r\n"
+		"SEQ: %u\r\n"
+		"CONNECTION: close\r\n"
+		"CACHE-CONTROL: no-cache\r\n"
+		"\r\n";
+	struct upnp_event_notify *obj;
+	char host[INET_ADDRSTRLEN];
+	char *body;
+	int len, size;
+
+	if (sub->service == EContentDirectory)
+		body = getVarsContentDirectory(&len);
+	else
+		body = getVarsConnectionManager(&len);
+	obj = calloc(1, sizeof(struct upnp_event_notify));
+	size = sizeof(notifyhead) + strlen(sub->path) + 128 + len;
+	if (obj)
+		obj->buffer = malloc(size);
+	if (!body || !obj || !obj->buffer)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Allocation failed for the event of %s\n", sub->sid);
+		free(body);
+		if (obj)
+			free(obj->buffer);
+		free(obj);
+		return;
+	}
+
+	inet_ntop(AF_INET, &sub->addr.sin_addr, host, sizeof(host));
+	obj->tosend = snprintf(obj->buffer, size, notifyhead, sub->path, host,
+	                       ntohs(sub->addr.sin_port), len, sub->sid, sub->seq);
+	memcpy(obj->buffer + obj->tosend, body, len);
+	obj->tosend += len;
+	free(body);
+	obj->s = -1;
+	obj->state = ECreated;
+	obj->deadline = now + NOTIFY_TIMEOUT;
+	obj->addr = sub->addr;
+	strcpy(obj->sid, sub->sid);
+	LIST_INSERT_HEAD(&notifylist, obj, entries);
+
+	/* it wraps to 1, 0 being the initial event */
+	sub->seq = sub->seq == UINT32_MAX ? 1 : sub->seq + 1;
+	sub->pending = 0;
+	sub->sending = 1;
+}
+
+static void
+upnp_event_notify_connect(struct upnp_event_notify *obj)
+{
+	obj->s = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (obj->s < 0)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Events socket(): %s\n", strerror(errno));
+		obj->state = EError;
+		return;
+	}
+	if (connect(obj->s, (struct sockaddr *)&obj->addr, sizeof(obj->addr)) < 0)
+	{
+		if (errno != EINPROGRESS)
+		{
+			DPRINTF(E_WARN, L_HTTP, "Events connect(%s): %s\n", obj->sid, strerror(errno));
+			obj->state = EError;
+			return;
+		}
+		obj->state = EConnecting;
+	}
+	else
+		obj->state = ESending;
+}
+
+static void
+upnp_event_send(struct upnp_event_notify *obj)
+{
+	int n;
+
+	n = send(obj->s, obj->buffer + obj->sent, obj->tosend - obj->sent, MSG_NOSIGNAL);
+	if (n < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		DPRINTF(E_WARN, L_HTTP, "Events send(%s): %s\n", obj->sid, strerror(errno));
+		obj->state = EError;
+		return;
+	}
+	obj->sent += n;
+	if (obj->sent == obj->tosend)
+		obj->state = EWaitingForResponse;
+}
+
+static void
+upnp_event_recv(struct upnp_event_notify *obj)
+{
+	char buf[512];
+	int n;
+
+	n = recv(obj->s, buf, sizeof(buf) - 1, 0);
+	if (n < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		DPRINTF(E_WARN, L_HTTP, "Events recv(%s): %s\n", obj->sid, strerror(errno));
+		obj->state = EError;
+		return;
+	}
+	if (n == 0)
+	{
+		DPRINTF(E_WARN, L_HTTP, "Event %s: connection closed without a response\n", obj->sid);
+		obj->state = EError;
+		return;
+	}
+	/* the status line is all we need */
+	buf[n] = '\0';
+	if (strncmp(buf, "HTTP/1.", 7) != 0 || strncmp(buf + 8, " 200", 4) != 0)
+		DPRINTF(E_WARN, L_HTTP, "Event %s: %.*s\n", obj->sid, (int)strcspn(buf, "\r\n"), buf);
+	obj->state = EFinished;
+}
+
+static void
+upnp_event_notify_free(struct upnp_event_notify *obj)
+{
+	struct subscriber *sub;
+
+	if (obj->s >= 0)
+		close(obj->s);
+	pthread_mutex_lock(&lock);
+	for (sub = subscriberlist.lh_first; sub; sub = sub->entries.le_next)
+	{
+		if (strcmp(sub->sid, obj->sid) == 0)
+		{
+			sub->sending = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	LIST_REMOVE(obj, entries);
+	free(obj->buffer);
+	free(obj);
+}
+
+static inline int
+min_wait(int wait, int t)
+{
+	if (t < 0)
+		t = 0;
+	return (wait < 0 || t < wait) ? t : wait;
+}
+
+int
+upnpevents_selectfds(fd_set *readset, fd_set *writeset, int *max_fd, time_t now)
+{
+	struct subscriber *sub, *next;
+	struct upnp_event_notify *obj;
+	int wait = -1;
+	int i;
+
+	pthread_mutex_lock(&lock);
+	if (!evented_started)
+	{
+		evented_update_id = updateID;
+		evented_started = 1;
+	}
+	if (efd < 0)
+	{
+		efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (efd < 0)
+			DPRINTF(E_ERROR, L_HTTP, "Events eventfd(): %s\n", strerror(errno));
+	}
+	for (i = EContentDirectory; i <= EConnectionManager; i++)
+	{
+		if (!services[i].changed)
+			continue;
+		if (now >= services[i].last + runtime_vars.event_interval || now < services[i].last)
+		{
+			if (i == EContentDirectory)
+				update_container_ids();
+			for (sub = subscriberlist.lh_first; sub; sub = sub->entries.le_next)
+			{
+				if (sub->service == i)
+					sub->pending = 1;
+			}
+			services[i].changed = 0;
+			services[i].last = now;
+		}
+		else
+			wait = min_wait(wait, services[i].last + runtime_vars.event_interval - now);
+	}
+	for (sub = subscriberlist.lh_first; sub; sub = next)
+	{
+		next = sub->entries.le_next;
+		if (sub->expires <= now)
+		{
+			DPRINTF(E_DEBUG, L_HTTP, "Subscription %s expired\n", sub->sid);
+			LIST_REMOVE(sub, entries);
+			n_subscribers--;
+			free(sub);
+			continue;
+		}
+		if (sub->pending && !sub->sending)
+			upnp_event_create_notify(sub, now);
+		wait = min_wait(wait, sub->expires - now);
+	}
+	/* the database is only looked at for changes when the main loop
+	 * wakes up, which must be often enough for the subscribers */
+	if (n_subscribers)
+		wait = min_wait(wait, runtime_vars.event_interval);
+	if (efd >= 0)
+	{
+		FD_SET(efd, readset);
+		*max_fd = MAX(*max_fd, efd);
+	}
+	pthread_mutex_unlock(&lock);
+
+	for (obj = notifylist.lh_first; obj; obj = obj->entries.le_next)
+	{
+		if (obj->state == ECreated)
+			upnp_event_notify_connect(obj);
+		switch (obj->state)
+		{
+		case EConnecting:
+		case ESending:
+			FD_SET(obj->s, writeset);
+			break;
+		case EWaitingForResponse:
+			FD_SET(obj->s, readset);
+			break;
+		default:
+			/* to be freed right away */
+			wait = 0;
+			continue;
+		}
+		*max_fd = MAX(*max_fd, obj->s);
+		wait = min_wait(wait, obj->deadline - now);
+	}
+
+	return wait;
+}
+
+void
+upnpevents_processfds(fd_set *readset, fd_set *writeset, time_t now)
+{
+	struct upnp_event_notify *obj, *next;
+	uint64_t n;
+	socklen_t len;
+	int err;
+
+	if (efd >= 0 && FD_ISSET(efd, readset) &&
+	    read(efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		DPRINTF(E_ERROR, L_HTTP, "Events read(eventfd): %s\n", strerror(errno));
+
+	for (obj = notifylist.lh_first; obj; obj = next)
+	{
+		next = obj->entries.le_next;
+		if (obj->s >= 0 && (FD_ISSET(obj->s, readset) || FD_ISSET(obj->s, writeset)))
+		{
+			switch (obj->state)
+			{
+			case EConnecting:
+				len = sizeof(err);
+				if (getsockopt(obj->s, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+					err = errno;
+				if (err)
+				{
+					DPRINTF(E_WARN, L_HTTP, "Events connect(%s): %s\n", obj->sid, strerror(err));
+					obj->state = EError;
+					break;
+				}
+				obj->state = ESending;
+				/* fall through */
+			case ESending:
+				upnp_event_send(obj);
+				break;
+			case EWaitingForResponse:
+				upnp_event_recv(obj);
+				break;
+			default:
+				break;
+			}
+		}
+		if (obj->state < EFinished && now >= obj->deadline)
+		{
+			DPRINTF(E_WARN, L_HTTP, "Event %s timed out\n", obj->sid);
+			obj->state = EError;
+		}
+		if (obj->state == EFinished || obj->state == EError)
+			upnp_event_notify_free(obj);
+	}
+}
+
+void
+upnpevents_removeSubscribers(void)
+{
+	struct subscriber *sub;
+
+	while (notifylist.lh_first)
+		upnp_event_notify_free(notifylist.lh_first);
+
+	pthread_mutex_lock(&lock);
+	while ((sub = subscriberlist.lh_first))
+	{
+		LIST_REMOVE(sub, entries);
+		free(sub);
+	}
+	n_subscribers = 0;
+	if (efd >= 0)
+		close(efd);
+	efd = -1;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,105 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __UPNPEVENTS_H__
+#define __UPNPEVENTS_H__
+
+#include <time.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+
+/* GENA eventing: control points SUBSCRIBE to a service's event URL and are
+ * sent a NOTIFY with the evented variables when they change, instead of
+ * polling.  Subscriptions may be made from any thread; the NOTIFYs are
+ * sent from the main loop, without blocking it. */
+
+/* "uuid:" and a UUID */
+#define SID_LEN		42
+
+enum subscriber_service_enum {
+	EContentDirectory = 1,
+	EConnectionManager
+};
+
+/**
+ * Note that an evented variable of a service has changed.  Subscribers are
+ * told at most once every event_interval seconds, with the values as they
+ * are then, so a burst of changes makes a single event.
+ */
+void upnp_event_var_change_notify(enum subscriber_service_enum service);
+
+/**
+ * @return The value of ContainerUpdateIDs, the containers changed in the
+ *         time the last ContentDirectory event covered, for the main loop.
+ */
+const char *upnp_event_container_update_ids(void);
+
+/**
+ * Subscribe to the events of a service.  The initial event follows.
+ * @param callback The delivery URL, which must be on the subscriber's host.
+ * @param callbacklen The length of callback, which need not end in a NUL.
+ * @param client The address the request came from.
+ * @param timeout The seconds asked for, 0 for the default; set to the
+ *                seconds granted.
+ * @param sid Filled with the subscription's SID.
+ * @return 0 on success, -1 if callback is unusable, -2 if there are too
+ *         many subscriptions already.
+ */
+int upnpevents_addSubscriber(enum subscriber_service_enum service,
+                             const char *callback, int callbacklen,
+                             struct in_addr client, int *timeout, char sid[SID_LEN]);
+
+/**
+ * Renew a subscription before it expires.
+ * @param timeout As for upnpevents_addSubscriber().
+ * @return 0 on success, -1 if there is no such subscription.
+ */
+int upnpevents_renewSubscription(enum subscriber_service_enum service,
+                                 const char *sid, int sidlen, int *timeout);
+
+/**
+ * Cancel a subscription.
+ * @return 0 on success, -1 if there is no such subscription.
+ */
+int upnpevents_removeSubscriber(enum subscriber_service_enum service,
+                                const char *sid, int sidlen);
+
+/**
+ * @return The number of subscriptions.
+ */
+int upnpevents_subscribers(void);
+
+/**
+ * Start the events that are due, drop the subscriptions that have expired,
+ * and add the descriptors of the NOTIFYs on their way to the sets.
+ * @param now The time of day in the main loop.
+ * @return The seconds until this must be called again, or -1 if there is
+ *         nothing to wait for.
+ */
+int upnpevents_selectfds(fd_set *readset, fd_set *writeset, int *max_fd, time_t now);
+
+/**
+ * Carry on with the NOTIFYs whose descriptors are ready, and give up on
+ * those that have taken too long.
+ */
+void upnpevents_processfds(fd_set *readset, fd_set *writeset, time_t now);
+
+/**
+ * Drop all subscriptions and the NOTIFYs on their way.
+ */
+void upnpevents_removeSubscribers(void);
+
+#endif // __UPNPEVENTS_H__
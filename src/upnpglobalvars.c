@@ -79,11 +79,12 @@ int sssdp = -1;
 const char * minissdpdsocketpath = "./cache/run/minissdpd.sock";
 
 /* UPnP-A/V [DLNA] */
-sqlite3 *db;
+__thread sqlite3 *db;
 char friendly_name[FRIENDLYNAME_MAX_LEN] = "DLNA_TEST_KGRZE";
 char db_path[PATH_MAX] = {'\0'};
 char log_path[PATH_MAX] = {'\0'};
 struct media_dir_s * media_dirs = NULL;
 volatile short int quitting = 0;
 volatile uint32_t updateID = 0;
+int search_fts = 0;
 const char *force_sort_criteria = NULL;
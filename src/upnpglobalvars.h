@@ -64,7 +64,7 @@
 # define SERVER_NAME "MiniDLNA"
 #endif
 
-#define DB_VERSION 11
+#define DB_VERSION 19
 
 #ifdef ENABLE_NLS
 #define _(string) gettext(string)
@@ -214,7 +214,7 @@ extern int sssdp;
 extern const char *minissdpdsocketpath;
 
 /* UPnP-A/V [DLNA] */
-extern sqlite3 *db;
+extern __thread sqlite3 *db;
 #define FRIENDLYNAME_MAX_LEN 64
 extern char friendly_name[];
 extern char db_path[];
@@ -222,6 +222,8 @@ extern char log_path[];
 extern struct media_dir_s *media_dirs;
 extern volatile short int quitting;
 extern volatile uint32_t updateID;
+/* Whether the database has a full-text index, set before any worker starts */
+extern int search_fts;
 extern const char *force_sort_criteria;
 
 #endif
@@ -75,7 +75,12 @@
 #include "sql.h"
 #include <libexif/exif-loader.h>
 #include "process.h"
+#include "streamer.h"
+#include "soapworker.h"
+#include "prefetch.h"
+#include "objtree.h"
 #include "sendfile.h"
+#include "upnpevents.h"
 
 #define MAX_BUFFER_SIZE 2147483647
 #define MIN_BUFFER_SIZE 65536
@@ -90,6 +95,8 @@ enum event_type {
 
 static void SendResp_dlnafile(struct upnphttp *, char * url);
 
+__thread int defer_response = 0;
+
 struct upnphttp * 
 New_upnphttp(int s)
 {
@@ -107,6 +114,8 @@ New_upnphttp(int s)
 void
 CloseSocket_upnphttp(struct upnphttp * h)
 {
+	if(defer_response)
+		return;
 	if(close(h->socket) < 0)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "CloseSocket_upnphttp: close(%d): %s\n", h->socket, strerror(errno));
@@ -430,6 +439,21 @@ Send406(struct upnphttp * h)
 	CloseSocket_upnphttp(h);
 }
 
+/* very minimalistic 412 error message */
+static void
+Send412(struct upnphttp * h)
+{
+	static const char body412[] =
+		"<HTML><HEAD><TITLE>412 Precondition Failed</TITLE></HEAD>"
+		"<BODY><H1>Precondition Failed</H1>An invalid subscription"
+		" was requested.</BODY></HTML>\r\n";
+	h->respflags = FLAG_HTML;
+	BuildResp2_upnphttp(h, 412, "Precondition Failed",
+	                    body412, sizeof(body412) - 1);
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+}
+
 /* very minimalistic 416 error message */
 static void
 Send416(struct upnphttp * h)
@@ -505,9 +529,11 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 		{
 			/* we can process the request */
 			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n", h->req_soapActionLen, h->req_soapAction);
-			ExecuteSoapAction(h, 
-				h->req_soapAction,
-				h->req_soapActionLen);
+			/* off the main loop if there is a worker for it */
+			if(soap_workers_submit(h) != 0)
+				ExecuteSoapAction(h, 
+					h->req_soapAction,
+					h->req_soapActionLen);
 		}
 		else
 		{
@@ -528,6 +554,137 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 	}
 }
 
+/* The service whose event URL this is, 0 if none */
+static enum subscriber_service_enum
+event_service(const char * path)
+{
+	if(strcmp(path, CONTENTDIRECTORY_EVENTURL) == 0)
+		return EContentDirectory;
+	if(strcmp(path, CONNECTIONMGR_EVENTURL) == 0)
+		return EConnectionManager;
+	return 0;
+}
+
+/* Tell a subscription from a renewal, answering the requests that are
+ * neither as UPnP Device Architecture 4.1.2 says */
+static enum event_type
+check_event(struct upnphttp * h)
+{
+	if(h->req_Callback)
+	{
+		if(h->req_SID)
+		{
+			Send400(h);
+			return E_INVALID;
+		}
+		if(!h->req_NT || h->req_NTLen != 10 ||
+		   strncmp(h->req_NT, "upnp:event", 10) != 0)
+		{
+			Send412(h);
+			return E_INVALID;
+		}
+		return E_SUBSCRIBE;
+	}
+	if(h->req_SID)
+	{
+		if(h->req_NT)
+		{
+			Send400(h);
+			return E_INVALID;
+		}
+		return E_RENEW;
+	}
+	Send412(h);
+	return E_INVALID;
+}
+
+static void
+ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
+{
+	enum subscriber_service_enum service;
+	char sid[SID_LEN];
+	int ret;
+
+	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPSubscribe %s\n", path);
+	DPRINTF(E_DEBUG, L_HTTP, "Callback '%.*s' Timeout=%d\n",
+	        h->req_CallbackLen, h->req_Callback, h->req_Timeout);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+
+	service = event_service(path);
+	if(!service)
+	{
+		Send404(h);
+		return;
+	}
+	switch(check_event(h))
+	{
+	case E_SUBSCRIBE:
+		ret = upnpevents_addSubscriber(service, h->req_Callback, h->req_CallbackLen,
+		                               h->clientaddr, &h->req_Timeout, sid);
+		if(ret == -1)
+		{
+			Send412(h);
+			return;
+		}
+		else if(ret < 0)
+		{
+			Send500(h);
+			return;
+		}
+		h->req_SID = sid;
+		h->req_SIDLen = strlen(sid);
+		break;
+	case E_RENEW:
+		if(upnpevents_renewSubscription(service, h->req_SID, h->req_SIDLen,
+		                                &h->req_Timeout) != 0)
+		{
+			Send412(h);
+			return;
+		}
+		break;
+	default:
+		return;
+	}
+	h->respflags |= FLAG_TIMEOUT | FLAG_SID;
+	BuildResp_upnphttp(h, 0, 0);
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+}
+
+static void
+ProcessHTTPUnSubscribe_upnphttp(struct upnphttp * h, const char * path)
+{
+	enum subscriber_service_enum service;
+
+	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPUnSubscribe %s\n", path);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+
+	service = event_service(path);
+	if(!service)
+	{
+		Send404(h);
+		return;
+	}
+	if(!h->req_SID)
+	{
+		Send412(h);
+		return;
+	}
+	if(h->req_Callback || h->req_NT)
+	{
+		Send400(h);
+		return;
+	}
+	if(upnpevents_removeSubscriber(service, h->req_SID, h->req_SIDLen) != 0)
+	{
+		Send412(h);
+		return;
+	}
+	BuildResp_upnphttp(h, 0, 0);
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+}
+
 /* Parse and process Http Query 
  * called once all the HTTP headers have been received. */
 static void
@@ -659,6 +816,16 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 			Send404(h);
 		}
 	}
+	else if(strcmp("SUBSCRIBE", HttpCommand) == 0)
+	{
+		h->req_command = ESubscribe;
+		ProcessHTTPSubscribe_upnphttp(h, HttpUrl);
+	}
+	else if(strcmp("UNSUBSCRIBE", HttpCommand) == 0)
+	{
+		h->req_command = EUnSubscribe;
+		ProcessHTTPUnSubscribe_upnphttp(h, HttpUrl);
+	}
 	else
 	{
 		DPRINTF(E_WARN, L_HTTP, "Unsupported HTTP Command %s\n", HttpCommand);
@@ -782,6 +949,7 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 		"Content-Length: %d\r\n"
 		"Server: " MINIDLNA_SERVER_STRING "\r\n";
 	time_t curtime = time(NULL);
+	struct tm tm;
 	char date[30];
 	int templen;
 	struct string_s res;
@@ -813,7 +981,7 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	if(h->reqflags & FLAG_LANGUAGE) {
 		strcatf(&res, "Content-Language: en\r\n");
 	}
-	strftime(date, 30,"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&curtime));
+	strftime(date, 30,"%a, %d %b %Y %H:%M:%S GMT" , gmtime_r(&curtime, &tm));
 	strcatf(&res, "Date: %s\r\n", date);
 	strcatf(&res, "EXT:\r\n");
 	strcatf(&res, "\r\n");
@@ -849,6 +1017,8 @@ void
 SendResp_upnphttp(struct upnphttp * h)
 {
 	int n;
+	if(defer_response)
+		return;
 	DPRINTF(E_DEBUG, L_HTTP, "HTTP RESPONSE: %.*s\n", h->res_buflen, h->res_buf);
 	n = send(h->socket, h->res_buf, h->res_buflen, 0);
 	if(n<0)
@@ -916,10 +1086,11 @@ static void
 start_dlna_header(struct string_s *str, int respcode, const char *tmode, const char *mime)
 {
 	char date[30];
+	struct tm tm;
 	time_t now;
 
 	now = time(NULL);
-	strftime(date, sizeof(date),"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&now));
+	strftime(date, sizeof(date),"%a, %d %b %Y %H:%M:%S GMT" , gmtime_r(&now, &tm));
 	strcatf(str, "HTTP/1.1 %d OK\r\n"
 	             "Connection: close\r\n"
 	             "Date: %s\r\n"
@@ -966,60 +1137,139 @@ _open_file(const char *orig_path)
 	return fd;
 }
 
+/* finish_dlna_header()
+ * validate the requested range against the file size and append the
+ * length, range and DLNA feature headers.  On an invalid range the
+ * error response is sent and -1 is returned. */
+static int
+finish_dlna_header(struct upnphttp *h, struct string_s *str, off_t size,
+                   const char *mime, const char *dlna)
+{
+	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
+	off_t total;
+
+	if( h->reqflags & FLAG_RANGE )
+	{
+		if( !h->req_RangeEnd || h->req_RangeEnd == size )
+		{
+			h->req_RangeEnd = size - 1;
+		}
+		if( (h->req_RangeStart > h->req_RangeEnd) || (h->req_RangeStart < 0) )
+		{
+			DPRINTF(E_WARN, L_HTTP, "Specified range was invalid!\n");
+			Send400(h);
+			return -1;
+		}
+		if( h->req_RangeEnd >= size )
+		{
+			DPRINTF(E_WARN, L_HTTP, "Specified range was outside file boundaries!\n");
+			Send416(h);
+			return -1;
+		}
+
+		total = h->req_RangeEnd - h->req_RangeStart + 1;
+		strcatf(str, "Content-Length: %jd\r\n"
+		             "Content-Range: bytes %jd-%jd/%jd\r\n",
+		             (intmax_t)total, (intmax_t)h->req_RangeStart,
+		             (intmax_t)h->req_RangeEnd, (intmax_t)size);
+	}
+	else
+	{
+		h->req_RangeEnd = size - 1;
+		total = size;
+		strcatf(str, "Content-Length: %jd\r\n", (intmax_t)total);
+	}
+
+	switch( *mime )
+	{
+		case 'i':
+			dlna_flags |= DLNA_FLAG_TM_I;
+			break;
+		case 'a':
+		case 'v':
+		default:
+			dlna_flags |= DLNA_FLAG_TM_S;
+			break;
+	}
+
+	strcatf(str, "Accept-Ranges: bytes\r\n"
+	             "contentFeatures.dlna.org: %sDLNA.ORG_OP=%02X;DLNA.ORG_CI=%X;DLNA.ORG_FLAGS=%08X%024X\r\n\r\n",
+	             dlna, 1, 0, dlna_flags, 0);
+
+	return 0;
+}
+
 static void
 SendResp_dlnafile(struct upnphttp *h, char *object)
 {
 	char header[1024];
 	struct string_s str;
-	char buf[128];
-	char **result;
-	int rows, ret;
-	off_t total, offset, size;
+	sqlite3_stmt *stmt;
+	struct objtree *tree;
+	const struct objtree_node *node;
+	int ret;
+	off_t offset, size = -1;
 	int64_t id;
 	int sendfh;
-	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
 	const char *tmode;
-	static struct { int64_t id;
+	static __thread struct { int64_t id;
 	                char path[PATH_MAX];
 	                char mime[32];
 	                char dlna[96];
+	                off_t size;
 	              } last_file = { 0 };
-	pid_t newpid = 0;
+	pid_t newpid = -1;
 
 	id = strtoll(object, NULL, 10);
-	if( id != last_file.id )
+	if( id != last_file.id && (tree = objtree_get()) )
+	{
+		struct didl_object obj;
+
+		node = objtree_lookup(tree, id);
+		if( node )
+			objtree_object(tree, node, &obj);
+		if( !node || !objtree_path(tree, node) || !obj.mime )
+		{
+			DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
+			objtree_put(tree);
+			Send404(h);
+			return;
+		}
+		last_file.id = id;
+		strncpyt(last_file.path, objtree_path(tree, node), sizeof(last_file.path));
+		strncpyt(last_file.mime, obj.mime, sizeof(last_file.mime));
+		last_file.size = obj.size;
+		last_file.dlna[0] = '\0';
+		objtree_put(tree);
+	}
+	else if( id != last_file.id )
 	{
-		snprintf(buf, sizeof(buf), "SELECT PATH, MIME from OBJECTS where ID = '%lld'", (long long)id);
-		ret = sql_get_table(db, buf, &result, &rows, NULL);
-		if( (ret != SQLITE_OK) )
+		stmt = sql_bind_cached(db, "SELECT PATH, MIME, SIZE from OBJECTS where ID = ?", "I", id);
+		ret = stmt ? sqlite3_step(stmt) : SQLITE_ERROR;
+		if( ret != SQLITE_ROW && ret != SQLITE_DONE )
 		{
 			DPRINTF(E_ERROR, L_HTTP, "Didn't find valid file for %lld!\n", (long long)id);
+			if( stmt )
+				sqlite3_reset(stmt);
 			Send500(h);
 			return;
 		}
-		if( !rows || !result[2] || !result[3] )
+		if( ret == SQLITE_DONE || sqlite3_column_type(stmt, 0) == SQLITE_NULL ||
+		    sqlite3_column_type(stmt, 1) == SQLITE_NULL )
 		{
 			DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
-			sqlite3_free_table(result);
+			sqlite3_reset(stmt);
 			Send404(h);
 			return;
 		}
 		/* Cache the result */
 		last_file.id = id;
-		strncpy(last_file.path, result[2], sizeof(last_file.path)-1);
-		if( result[4] )
-		{
-			strncpy(last_file.mime, result[3], sizeof(last_file.mime)-1);
-		}
+		strncpyt(last_file.path, (const char *)sqlite3_column_text(stmt, 0), sizeof(last_file.path));
+		strncpyt(last_file.mime, (const char *)sqlite3_column_text(stmt, 1), sizeof(last_file.mime));
+		last_file.size = sqlite3_column_type(stmt, 2) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 2);
 
 		last_file.dlna[0] = '\0';
-		sqlite3_free_table(result);
-	}
-	newpid = process_fork();
-	if( newpid > 0 )
-	{
-		CloseSocket_upnphttp(h);
-		return;
+		sqlite3_reset(stmt);
 	}
 
 	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, last_file.path);
@@ -1030,7 +1280,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		{
 			DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
 			Send406(h);
-			goto error;
+			return;
 		}
 	}
 	else if( h->reqflags & FLAG_XFERINTERACTIVE )
@@ -1039,7 +1289,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		{
 			DPRINTF(E_WARN, L_HTTP, "Bad realTimeInfo flag with Interactive request!\n");
 			Send400(h);
-			goto error;
+			return;
 		}
 		if( strncmp(last_file.mime, "image", 5) != 0 )
 		{
@@ -1049,11 +1299,89 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			if(GETFLAG(DLNA_STRICT_MASK) )
 			{
 				Send406(h);
-				goto error;
+				return;
 			}
 		}
 	}
 
+	/* Playback getting close to the end of a file, get the next one in
+	 * the folder ready */
+	if( (h->reqflags & FLAG_RANGE) && h->req_command != EHead && last_file.size > 0 &&
+	    h->req_RangeStart >= last_file.size / 100 * PREFETCH_NEAR_END )
+	{
+		const struct objtree_node *next, *end;
+		int count;
+
+		tree = objtree_get();
+		if( !tree )
+			prefetch_hint_lookup("SELECT n.PATH from OBJECTS o, OBJECTS n "
+			                     "where o.ID = ? and n.PARENT = o.PARENT and n.IDX > o.IDX "
+			                     "and n.CLASS like 'item%' order by n.IDX limit 1", id);
+		else if( (node = objtree_lookup(tree, id)) && objtree_parent(tree, node) )
+		{
+			/* siblings follow each other in IDX order */
+			end = objtree_children(tree, objtree_parent(tree, node), &count) + count;
+			for( next = node + 1; next < end; next++ )
+			{
+				struct didl_object obj;
+
+				objtree_object(tree, next, &obj);
+				if( strncmp(obj.class, "item", 4) == 0 )
+				{
+					prefetch_hint(objtree_path(tree, next));
+					break;
+				}
+			}
+		}
+		objtree_put(tree);
+	}
+
+	/* HEAD requests and probes of empty files never transfer a body, so
+	 * answer them here instead of forking.  The file is looked at rather
+	 * than its SIZE, which may have changed since it was scanned. */
+	if( h->req_command == EHead || last_file.size <= 0 )
+	{
+		struct stat st;
+
+		if( stat(last_file.path, &st) != 0 )
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Error stating %s\n", last_file.path);
+			Send404(h);
+			return;
+		}
+		size = st.st_size;
+	}
+	if( h->req_command == EHead || size == 0 )
+	{
+		if( h->reqflags & FLAG_XFERBACKGROUND )
+			tmode = "Background";
+		else if( strncmp(last_file.mime, "image", 5) == 0 )
+			tmode = "Interactive";
+		else
+			tmode = "Streaming";
+
+		INIT_STR(str, header);
+		start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
+		if( finish_dlna_header(h, &str, size, last_file.mime, last_file.dlna) == 0 )
+		{
+			send_data(h, str.data, str.off, 0);
+			CloseSocket_upnphttp(h);
+		}
+		return;
+	}
+
+	/* With a streaming pool the headers are sent from here and the body
+	 * is handed to a worker; otherwise the whole response is forked off. */
+	if( !streamer_enabled() )
+	{
+		newpid = process_fork();
+		if( newpid > 0 )
+		{
+			CloseSocket_upnphttp(h);
+			return;
+		}
+	}
+
 	offset = h->req_RangeStart;
 	sendfh = _open_file(last_file.path);
 	if( sendfh < 0 ) {
@@ -1068,7 +1396,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 
 	INIT_STR(str, header);
 
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( (h->reqflags & FLAG_XFERBACKGROUND) && (newpid != 0 || setpriority(PRIO_PROCESS, 0, 19) == 0) )
 		tmode = "Background";
 	else if( strncmp(last_file.mime, "image", 5) == 0 )
 		tmode = "Interactive";
@@ -1077,61 +1405,24 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 
 	start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
 
-	if( h->reqflags & FLAG_RANGE )
-	{
-		if( !h->req_RangeEnd || h->req_RangeEnd == size )
-		{
-			h->req_RangeEnd = size - 1;
-		}
-		if( (h->req_RangeStart > h->req_RangeEnd) || (h->req_RangeStart < 0) )
-		{
-			DPRINTF(E_WARN, L_HTTP, "Specified range was invalid!\n");
-			Send400(h);
-			close(sendfh);
-			goto error;
-		}
-		if( h->req_RangeEnd >= size )
-		{
-			DPRINTF(E_WARN, L_HTTP, "Specified range was outside file boundaries!\n");
-			Send416(h);
-			close(sendfh);
-			goto error;
-		}
-
-		total = h->req_RangeEnd - h->req_RangeStart + 1;
-		strcatf(&str, "Content-Length: %jd\r\n"
-		              "Content-Range: bytes %jd-%jd/%jd\r\n",
-		              (intmax_t)total, (intmax_t)h->req_RangeStart,
-		              (intmax_t)h->req_RangeEnd, (intmax_t)size);
-	}
-	else
+	if( finish_dlna_header(h, &str, size, last_file.mime, last_file.dlna) != 0 )
 	{
-		h->req_RangeEnd = size - 1;
-		total = size;
-		strcatf(&str, "Content-Length: %jd\r\n", (intmax_t)total);
-	}
-
-	switch( *last_file.mime )
-	{
-		case 'i':
-			dlna_flags |= DLNA_FLAG_TM_I;
-			break;
-		case 'a':
-		case 'v':
-		default:
-			dlna_flags |= DLNA_FLAG_TM_S;
-			break;
+		close(sendfh);
+		goto error;
 	}
 
-	strcatf(&str, "Accept-Ranges: bytes\r\n"
-	              "contentFeatures.dlna.org: %sDLNA.ORG_OP=%02X;DLNA.ORG_CI=%X;DLNA.ORG_FLAGS=%08X%024X\r\n\r\n",
-	              last_file.dlna, 1, 0, dlna_flags, 0);
-
 	//DEBUG DPRINTF(E_DEBUG, L_HTTP, "RESPONSE: %s\n", str.data);
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
-		if( h->req_command != EHead )
-			send_file(h, sendfh, offset, h->req_RangeEnd);
+		if( !streamer_enabled() ||
+		    streamer_submit(h->socket, sendfh, offset, h->req_RangeEnd) != 0 )
+		{
+			/* Pool is full or gone, fall back to a child of our own */
+			if( streamer_enabled() )
+				newpid = process_fork();
+			if( newpid <= 0 )
+				send_file(h, sendfh, offset, h->req_RangeEnd);
+		}
 	}
 	close(sendfh);
 
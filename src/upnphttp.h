@@ -62,6 +62,8 @@
  states :
   0 - waiting for data to read
   1 - waiting for HTTP Post Content.
+  2 - waiting for the rest of a chunked request.
+  3 - waiting for a SOAP worker to answer.
   ...
   >= 100 - to be deleted
 */
@@ -107,8 +109,14 @@ struct upnphttp {
 	/*int res_contentlen;*/
 	/*int res_contentoff;*/		/* header length */
 	LIST_ENTRY(upnphttp) entries;
+	struct upnphttp *soap_next;	/* queued for or answered by a SOAP worker */
 };
 
+/* Set in the SOAP worker threads: SendResp_upnphttp() and
+ * CloseSocket_upnphttp() leave the built response and the socket to the
+ * main loop. */
+extern __thread int defer_response;
+
 #define FLAG_TIMEOUT            0x00000001
 #define FLAG_SID                0x00000002
 #define FLAG_RANGE              0x00000004
@@ -60,6 +60,7 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "upnpglobalvars.h"
 #include "utils.h"
@@ -69,6 +70,13 @@
 #include "getifaddr.h"
 #include "scanner.h"
 #include "sql.h"
+#include "objectid.h"
+#include "search.h"
+#include "didl.h"
+#include "browsecache.h"
+#include "objtree.h"
+#include "prefetch.h"
+#include "precompute.h"
 #include "log.h"
 
 #ifdef __sparc__ /* Sorting takes too long on slow processors with very large containers */
@@ -162,161 +170,882 @@ BuildSendAndCloseSoapResp(struct upnphttp * h,
 	CloseSocket_upnphttp(h);
 }
 
-/* Standard DLNA/UPnP filter flags */
-#define FILTER_RES				0x00000040
-#define FILTER_RES_SIZE				0x00001000
-#define FILTER_UPNP_STORAGEUSED			0x00400000
-/* Masks */
-#define STANDARD_FILTER_MASK			0x00FFFFFF
+/* A Filter compiled into the properties to write and the columns the
+ * callback needs for them.  Columns no property asks for are selected as
+ * NULL, which keeps the callback's argv layout fixed. */
+struct filter
+{
+	uint32_t flags;
+	char columns[160];
+};
 
-static uint32_t
-set_filter_flags(char *filter)
+static const struct
 {
-	char *item, *saveptr = NULL;
+	const char *property;
+	uint32_t flags;
+}
+filter_properties[] =
+{
+	{ "@childCount", FILTER_CHILDCOUNT },
+	{ "childCount", FILTER_CHILDCOUNT },
+	{ "res", FILTER_RES },
+	{ "res@size", FILTER_RES|FILTER_RES_SIZE },
+	{ "upnp:storageUsed", FILTER_UPNP_STORAGEUSED },
+	{ "*", STANDARD_FILTER_MASK },
+	{ NULL, 0 }
+};
+
+static void
+compile_filter(const char *filter, struct filter *compiled)
+{
+	const char *item = filter;
+	size_t len;
 	uint32_t flags = 0;
+	int i;
 
 	if( !filter || (strlen(filter) <= 1) ) {
 		/* Not the full 32 bits.  Skip vendor-specific stuff by default. */
 		flags = STANDARD_FILTER_MASK;
+		item = NULL;
 	}
-	if (flags)
-		return flags;
-
-	item = strtok_r(filter, ",", &saveptr);
-	while( item != NULL )
+	while( item && *item )
 	{
-		if( saveptr )
-			*(item-1) = ',';
 		while( isspace(*item) )
 			item++;
-		if( strcmp(item, "res") == 0 )
+		len = strcspn(item, ",");
+		while( len && isspace(item[len-1]) )
+			len--;
+		for( i = 0; filter_properties[i].property; i++ )
 		{
-			flags |= FILTER_RES;
+			if( strlen(filter_properties[i].property) == len &&
+			    strncmp(item, filter_properties[i].property, len) == 0 )
+			{
+				flags |= filter_properties[i].flags;
+				break;
+			}
 		}
-		item = strtok_r(NULL, ",", &saveptr);
+		/* Any attribute of res brings the element with it */
+		if( !filter_properties[i].property && strncmp(item, "res@", 4) == 0 )
+			flags |= FILTER_RES;
+		item = strchr(item, ',');
+		if( item )
+			item++;
 	}
 
-	return flags;
+	compiled->flags = flags;
+	/* Storage folders always carry upnp:storageUsed */
+	snprintf(compiled->columns, sizeof(compiled->columns),
+	         "IDX, ID, CLASS, %s, TITLE, %s, %s, %s, DIDL ",
+	         (flags & FILTER_RES_SIZE) ? "SIZE" : "NULL",
+	         (flags & FILTER_RES) ? "MIME" : "NULL",
+	         (flags & FILTER_CHILDCOUNT) ? "CHILD_COUNT" : "NULL",
+	         (flags & FILTER_UPNP_STORAGEUSED) ? "STORAGE_USED" :
+	         "case when CLASS = 'container.storageFolder' then STORAGE_USED end");
 }
 
-inline static void
-add_res(char *size, char *dlna_pn, char *mime,
-        char *detailID, const char *ext, struct Response *args)
+/* Clients send the same long Filter with every request, so keep what each
+ * distinct one compiled to */
+#define FILTER_CACHE	16
+
+static struct filter_cache {
+	unsigned int hash;
+	char *filter;
+	struct filter compiled;
+} filter_cache[FILTER_CACHE];
+static pthread_mutex_t filter_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+get_filter(const char *filter, struct filter *compiled)
 {
-	strcatf(args->str, "&lt;res ");
-	if( size && (args->filter & FILTER_RES_SIZE) ) {
-		strcatf(args->str, "size=\"%s\" ", size);
+	struct filter_cache *entry;
+	unsigned int hash;
+
+	if( !filter )
+	{
+		compile_filter(NULL, compiled);
+		return;
 	}
+	hash = DJBHash((uint8_t *)filter, strlen(filter));
+	entry = &filter_cache[hash % FILTER_CACHE];
 
-	strcatf(args->str, "protocolInfo=\"http-get:*:%s:%s\"&gt;"
-	                          "http://%s:%d/MediaItems/%s.%s"
-	                          "&lt;/res&gt;",
-	                          mime, dlna_pn, lan_addr[args->iface].str,
-	                          runtime_vars.port, detailID, ext);
+	pthread_mutex_lock(&filter_cache_lock);
+	if( entry->filter && entry->hash == hash && strcmp(entry->filter, filter) == 0 )
+	{
+		*compiled = entry->compiled;
+		pthread_mutex_unlock(&filter_cache_lock);
+		return;
+	}
+	pthread_mutex_unlock(&filter_cache_lock);
+
+	compile_filter(filter, compiled);
+
+	pthread_mutex_lock(&filter_cache_lock);
+	free(entry->filter);
+	entry->filter = strdup(filter);
+	entry->hash = hash;
+	entry->compiled = *compiled;
+	pthread_mutex_unlock(&filter_cache_lock);
 }
 
 static int
-get_child_count(const char *object)
+get_child_count(int64_t key)
 {
 	int ret;
-	ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", object);
+	ret = sql_get_int_cached(db, "SELECT CHILD_COUNT from OBJECTS where ID = ?", "I", key);
 
 	return (ret > 0) ? ret : 0;
 }
 
-#define COLUMNS "ID, CLASS, SIZE, TITLE, MIME "
-#define SELECT_COLUMNS "SELECT OBJECT_ID, PARENT_ID, " COLUMNS
+/* The UpdateID of a container, or of the container an item is in, 0 if
+ * there is no such object */
+static uint32_t
+get_update_id(int64_t key)
+{
+	int64_t ret;
+	ret = sql_get_int_cached(db, "SELECT coalesce(o.UPDATE_ID, p.UPDATE_ID) from OBJECTS o "
+	                             "left join OBJECTS p on p.ID = o.PARENT where o.ID = ?", "I", key);
+
+	return (ret > 0) ? ret : 0;
+}
+
+static uint32_t
+tree_update_id(const struct objtree *tree, const struct objtree_node *node)
+{
+	const struct objtree_node *parent;
+
+	if( !node->update_id && (parent = objtree_parent(tree, node)) )
+		return parent->update_id;
+	return node->update_id;
+}
+
+/* The UpdateID Browse answers with and caches responses under, that of the
+ * container listed.  The scanner sets it on every container up to the root
+ * whenever something below changes, so it covers what is listed in full.
+ * SystemUpdateID for objects there are none of. */
+static uint32_t
+browse_update_id(const char *object_id)
+{
+	struct objtree *tree;
+	const struct objtree_node *node;
+	uint32_t update_id = 0;
+	int64_t key;
+
+	if( (tree = objtree_get()) )
+	{
+		if( (node = objtree_find(tree, object_id, NULL, 0)) )
+			update_id = tree_update_id(tree, node);
+		objtree_put(tree);
+	}
+	else if( (key = object_key(db, object_id, NULL, 0)) >= 0 )
+		update_id = get_update_id(key);
+
+	return update_id ? update_id : updateID;
+}
+
+/* Keyset pagination.  For containers listed in an order we can seek in,
+ * remember the last row of each page we served, so that the request for the
+ * page after it starts right there instead of skipping StartingIndex rows. */
+#define PAGE_MARKS	256
+
+static struct page_mark {
+	int64_t parent;
+	unsigned int order;
+	uint32_t update_id;	/* of the parent */
+	int offset;
+	int64_t last;
+} page_marks[PAGE_MARKS];
+static pthread_mutex_t page_marks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct page_mark *
+page_mark_slot(int64_t parent, unsigned int order, int offset)
+{
+	return &page_marks[((uint64_t)parent * 31 + order + offset) % PAGE_MARKS];
+}
+
+static int64_t
+get_page_mark(int64_t parent, uint32_t update_id, unsigned int order, int offset)
+{
+	struct page_mark *mark = page_mark_slot(parent, order, offset);
+	int64_t last = 0;
+
+	pthread_mutex_lock(&page_marks_lock);
+	if (mark->parent == parent && mark->order == order &&
+	    mark->offset == offset && mark->update_id == update_id)
+		last = mark->last;
+	pthread_mutex_unlock(&page_marks_lock);
+
+	return last;
+}
+
+static void
+set_page_mark(int64_t parent, uint32_t update_id, unsigned int order, int offset, int64_t last)
+{
+	struct page_mark *mark = page_mark_slot(parent, order, offset);
+
+	pthread_mutex_lock(&page_marks_lock);
+	mark->parent = parent;
+	mark->order = order;
+	mark->offset = offset;
+	mark->update_id = update_id;
+	mark->last = last;
+	pthread_mutex_unlock(&page_marks_lock);
+}
+
+/* Sortable properties, each with a (PARENT, column, IDX) index so sorted
+ * pages are read straight off it */
+#define SORT_CAPABILITIES "dc:title,upnp:class,res@size"
+
+static const struct
+{
+	const char *property;
+	const char *column;
+	int seekable;	/* never NULL, so keyset seeks can compare it */
+}
+sort_properties[] =
+{
+	{ "dc:title", "TITLE", 1 },
+	{ "upnp:class", "CLASS", 1 },
+	/* containers have no size, sort them as smaller than anything */
+	{ "res@size", "ifnull(SIZE, -1)", 1 },
+	{ NULL, NULL, 0 }
+};
+
+struct sort_order
+{
+	char terms[128];	/* ORDER BY terms, "TITLE desc, SIZE" */
+	char columns[128];	/* the same columns, "TITLE, SIZE" */
+	const char *first;	/* the first of them */
+	int direction;		/* 1 all ascending, -1 all descending, 0 mixed */
+	int seekable;
+};
+
+/* Parse SortCriteria like "+upnp:class,-dc:title".  Properties we cannot
+ * sort by are skipped.
+ * Returns 0, or -1 if any of the criteria were unsupported or invalid. */
+static int
+parse_sort_criteria(char *sortCriteria, struct sort_order *sort)
+{
+	char *item, *saveptr = NULL;
+	size_t terms = 0, columns = 0;
+	int desc, i, mixed = 0, ret = 0;
+
+	memset(sort, 0, sizeof(*sort));
+	sort->seekable = 1;
+	if( !sortCriteria )
+		return 0;
+
+	item = strtok_r(sortCriteria, ",", &saveptr);
+	while( item != NULL )
+	{
+		/* put back the comma strtok_r() took, the string is not ours */
+		if( item > sortCriteria )
+			*(item-1) = ',';
+		while( isspace(*item) )
+			item++;
+		desc = (*item == '-');
+		if( *item == '+' || *item == '-' )
+			item++;
+		for( i = 0; sort_properties[i].property; i++ )
+		{
+			if( strcmp(item, sort_properties[i].property) == 0 )
+				break;
+		}
+		if( !sort_properties[i].property ||
+		    terms + strlen(sort_properties[i].column) + 8 > sizeof(sort->terms) )
+		{
+			DPRINTF(E_DEBUG, L_HTTP, "Unsupported sort criteria: %s\n", item);
+			ret = -1;
+		}
+		else
+		{
+			terms += snprintf(sort->terms + terms, sizeof(sort->terms) - terms, "%s%s%s",
+			                  terms ? ", " : "", sort_properties[i].column, desc ? " desc" : "");
+			columns += snprintf(sort->columns + columns, sizeof(sort->columns) - columns, "%s%s",
+			                    columns ? ", " : "", sort_properties[i].column);
+			if( !sort->direction )
+			{
+				sort->direction = desc ? -1 : 1;
+				sort->first = sort_properties[i].column;
+			}
+			else if( sort->direction != (desc ? -1 : 1) )
+				mixed = 1;
+			sort->seekable &= sort_properties[i].seekable;
+		}
+		item = strtok_r(NULL, ",", &saveptr);
+	}
+	if( mixed )
+	{
+		sort->direction = 0;
+		sort->seekable = 0;
+	}
+
+	return ret;
+}
 
 #define NON_ZERO(x) (x && atoi(x))
 #define IS_ZERO(x) (!x || !atoi(x))
 
+/* Write an object into the response.  idx places it in the container
+ * listed, if any.  Returns 1 once the response is full. */
+static int
+add_object(struct Response *args, struct didl_object *obj, int64_t idx)
+{
+	char objectId[OBJECT_ID_LEN], parentId[OBJECT_ID_LEN];
+
+	obj->id = objectId;
+	obj->parent_id = args->parent_id;
+	if( obj->parent_id )
+		object_id_child(objectId, sizeof(objectId), obj->parent_id, idx);
+	else
+	{
+		/* Search results come from all over the tree */
+		if( object_id_from_key(db, obj->key, objectId, sizeof(objectId)) != 0 )
+			return 0;
+		object_id_parent(parentId, sizeof(parentId), objectId);
+		obj->parent_id = parentId;
+	}
+
+	if( didl_write(&args->didl, obj) != 0 )
+	{
+		DPRINTF(E_WARN, L_HTTP, "Response reached %d bytes, returning %d objects\n",
+		        MAX_RESPONSE_SIZE, args->returned);
+		args->full = 1;
+		return 1;
+	}
+	args->returned++;
+	args->last = obj->key;
+	if( args->nitems < PREFETCH_BROWSE_ITEMS && strncmp(obj->class, "item", 4) == 0 )
+		args->items[args->nitems++] = obj->key;
+
+	return 0;
+}
+
+static inline int64_t
+text_int(const char *text)
+{
+	return text ? strtoll(text, NULL, 10) : -1;
+}
+
 static int
 callback(void *args, int argc, char **argv, char **azColName)
 {
-	struct Response *passed_args = (struct Response *)args;
-	char *objectId = argv[0], *parent = argv[1], *id = argv[2], *class = argv[3], *size = argv[4], *title = argv[5], *mime = argv[6];
-	char dlna_buf[128];
-	const char *ext;
-	struct string_s *str = passed_args->str;
-	int ret = 0;
+	struct didl_object obj = {
+		.key = text_int(argv[1]),
+		.class = argv[2],
+		.size = text_int(argv[3]),
+		.title = argv[4],
+		.mime = argv[5],
+		.child_count = text_int(argv[6]),
+		.storage_used = text_int(argv[7]),
+		.didl = argv[8]
+	};
 
-	passed_args->returned++;
+	return add_object((struct Response *)args, &obj, text_int(argv[0]));
+}
 
-	if( strncmp(class, "item", 4) == 0 )
+static inline int64_t
+column_int(sqlite3_stmt *stmt, int col)
+{
+	return sqlite3_column_type(stmt, col) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, col);
+}
+
+/* Step a statement selecting the Filter columns into the response, taking
+ * them as they are typed.  Like list_objects(), stopping because the
+ * response is full is not an error. */
+static int
+step_objects(sqlite3_stmt *stmt, struct Response *args)
+{
+	struct didl_object obj;
+	int ret;
+
+	memset(&obj, 0, sizeof(obj));
+	while( (ret = sqlite3_step(stmt)) == SQLITE_ROW )
 	{
-		uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
-		/* We may need special handling for certain MIME types */
-		if( *mime == 'v' )
+		obj.key = sqlite3_column_int64(stmt, 1);
+		obj.class = (const char *)sqlite3_column_text(stmt, 2);
+		obj.size = column_int(stmt, 3);
+		obj.title = (const char *)sqlite3_column_text(stmt, 4);
+		obj.mime = (const char *)sqlite3_column_text(stmt, 5);
+		obj.child_count = column_int(stmt, 6);
+		obj.storage_used = column_int(stmt, 7);
+		obj.didl = (const char *)sqlite3_column_text(stmt, 8);
+		if( add_object(args, &obj, sqlite3_column_int64(stmt, 0)) )
+			break;
+	}
+	sqlite3_reset(stmt);
+
+	return (ret == SQLITE_DONE || args->full) ? SQLITE_OK : ret;
+}
+
+/* Run a query of objects into the response.  Stopping because the response
+ * is full is not an error, the client gets fewer than it asked for. */
+static int
+list_objects(const char *sql, struct Response *args, char **errmsg)
+{
+	int ret;
+
+	ret = sqlite3_exec(db, sql, callback, (void *)args, errmsg);
+	if( ret == SQLITE_ABORT && args->full )
+	{
+		sqlite3_free(*errmsg);
+		*errmsg = NULL;
+		ret = SQLITE_OK;
+	}
+
+	return ret;
+}
+
+/* Take an object from the tree as the Filter columns would select it */
+static void
+tree_object(const struct objtree *tree, const struct objtree_node *node,
+            const struct filter *filter, struct didl_object *obj)
+{
+	memset(obj, 0, sizeof(*obj));
+	objtree_object(tree, node, obj);
+	if( !(filter->flags & FILTER_RES_SIZE) )
+		obj->size = -1;
+	if( !(filter->flags & FILTER_RES) )
+		obj->mime = NULL;
+	if( !(filter->flags & FILTER_CHILDCOUNT) )
+		obj->child_count = -1;
+	if( !(filter->flags & FILTER_UPNP_STORAGEUSED) &&
+	    strcmp(obj->class, "container.storageFolder") != 0 )
+		obj->storage_used = -1;
+}
+
+/* List an object, or the page of its children asked for, from the tree.
+ * Returns the TotalMatches, and sets update_id to the UpdateID. */
+static int
+tree_objects(const struct objtree *tree, struct browse_request *req, int metadata,
+             const struct filter *filter, struct Response *args,
+             char *id, char *parent, uint32_t *update_id)
+{
+	const struct objtree_node *node, *children;
+	struct didl_object obj;
+	int count, i;
+
+	node = objtree_find(tree, req->object_id, id, OBJECT_ID_LEN);
+	if( node )
+		*update_id = tree_update_id(tree, node);
+	if( metadata )
+	{
+		object_id_parent(parent, OBJECT_ID_LEN, id);
+		args->parent_id = parent;
+		if( node )
 		{
-			dlna_flags |= DLNA_FLAG_TM_S;
+			tree_object(tree, node, filter, &obj);
+			add_object(args, &obj, node->idx);
 		}
+		return args->returned;
+	}
+
+	args->parent_id = id;
+	if( !node )
+		return 0;
+	children = objtree_children(tree, node, &count);
+	for( i = req->start; i < count && (req->count < 0 || i - req->start < req->count); i++ )
+	{
+		tree_object(tree, &children[i], filter, &obj);
+		if( add_object(args, &obj, children[i].idx) )
+			break;
+	}
 
-		strcpy(dlna_buf, "*");
+	return node->child_count > 0 ? node->child_count : 0;
+}
 
-		ret = strcatf(str, "&lt;item id=\"%s\" parentID=\"%s\" restricted=\"1\"", objectId, parent);
-		ret = strcatf(str, "&gt;"
-		                   "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
-		                   "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
-		                   title, class);
+/* Build the BrowseResponse body for a request into str.  hint prefetches
+ * the first items listed, for requests a client is waiting on.
+ * Returns 0, or the UPnP error code to answer with. */
+static int
+browse_response(struct browse_request *req, const struct filter *filter,
+                struct string_s *str, int *total, int hint)
+{
+	static const char resp0[] =
+			"<u:BrowseResponse "
+			"xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+			"<Result>"
+			"&lt;DIDL-Lite"
+			CONTENT_DIRECTORY_SCHEMAS;
+	char sql[1024];
+	sqlite3_stmt *stmt;
+	struct Response args;
+	int totalMatches = 0;
+	int ret, err = 0, i;
+	char where[512] = "";
+	char *orderBy = NULL;
+	char id[OBJECT_ID_LEN] = "", parent[OBJECT_ID_LEN];
+	const char *keyset = NULL, *first = NULL;
+	char seek[160];
+	struct sort_order sort;
+	unsigned int order = 0;
+	int64_t key, last = 0;
+	uint32_t update_id = 0;
+	int offset = 0;
+	int metadata, snapshot = 0;
+	struct objtree *tree = NULL;
+	const struct objtree_node *node;
 
-		if( passed_args->filter & FILTER_RES ) {
-			ext = mime_to_ext(mime);
-			add_res(size, dlna_buf, mime, id, ext, passed_args);
-		}
+	memset(&args, 0, sizeof(args));
+	str->data = malloc(DEFAULT_RESP_SIZE);
+	if( !str->data )
+		return 501;
+	str->size = DEFAULT_RESP_SIZE;
+	str->off = sprintf(str->data, "%s", resp0);
+	/* See if we need to include DLNA namespace reference */
+	didl_init(&args.didl, str, MAX_RESPONSE_SIZE, filter->flags,
+	          lan_addr[req->iface].str, runtime_vars.port);
+	strcatf(str, "&gt;\n");
 
-		ret = strcatf(str, "&lt;/item&gt;");
+	args.returned = 0;
+	args.requested = req->count;
+	args.flags = 0;
+	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
+	                         " * ObjectID: %s\n"
+	                         " * Count: %d\n"
+	                         " * StartingIndex: %d\n"
+	                         " * BrowseFlag: %s\n"
+	                         " * Filter: %s\n"
+	                         " * SortCriteria: %s\n",
+				req->object_id, req->count, req->start,
+	                        req->browse_flag, req->filter, req->sort);
+
+	metadata = (strcmp(req->browse_flag+6, "Metadata") == 0);
+	memset(&sort, 0, sizeof(sort));
+	if( metadata )
+		args.requested = 1;
+	/* If it's a DLNA client, return an error for bad sort criteria */
+	else if( parse_sort_criteria(req->sort, &sort) != 0 && GETFLAG(DLNA_STRICT_MASK) )
+	{
+		err = 709;
+		goto browse_error;
+	}
+
+	/* Listings in scan order are read straight off the object tree */
+	if( !sort.terms[0] && (tree = objtree_get()) )
+	{
+		totalMatches = tree_objects(tree, req, metadata, filter, &args, id, parent, &update_id);
+		goto browse_done;
 	}
-	else if( strncmp(class, "container", 9) == 0 )
+
+	/* Count and list from the same commit, however the scanner carries on */
+	snapshot = (sql_exec_cached(db, "BEGIN", "") == SQLITE_OK);
+
+	/* The statements only differ by the Filter, the sort and whether they
+	 * seek, so few are ever prepared; what differs between requests is
+	 * bound as ?1 the object, ?2 the row to seek past, ?3 and ?4 the
+	 * offset and count */
+	key = object_key(db, req->object_id, id, sizeof(id));
+	if( key >= 0 )
+		update_id = get_update_id(key);
+	if( metadata )
+	{
+		object_id_parent(parent, sizeof(parent), id);
+		args.parent_id = parent;
+		sqlite3_snprintf(sizeof(sql), sql, "SELECT %s"
+				"from OBJECTS where ID = ?1", filter->columns);
+	}
+	else
 	{
-		ret = strcatf(str, "&lt;container id=\"%s\" parentID=\"%s\" restricted=\"1\" ", objectId, parent);
-		ret = strcatf(str, "&gt;"
-		                   "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
-		                   "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
-		                   title, class);
-		if( (passed_args->filter & FILTER_UPNP_STORAGEUSED) || strcmp(class+10, "storageFolder") == 0 ) {
-			/* TODO: Implement real folder size tracking */
-			ret = strcatf(str, "&lt;upnp:storageUsed&gt;%s&lt;/upnp:storageUsed&gt;", (size ? size : "-1"));
+		args.parent_id = id;
+		/* List in scan order unless asked otherwise, with IDX breaking
+		 * ties.  keyset names the ORDER BY columns when they all sort the
+		 * same way and can be compared, which makes them a unique key
+		 * within the container. */
+		if (sort.terms[0])
+		{
+			xasprintf(&orderBy, "order by %s, IDX%s", sort.terms, sort.direction < 0 ? " desc" : "");
+			if (sort.seekable)
+			{
+				snprintf(seek, sizeof(seek), "%s, IDX", sort.columns);
+				keyset = seek;
+				first = sort.first;
+			}
+		}
+		else
+		{
+			orderBy = strdup("order by IDX");
+			keyset = first = "IDX";
+		}
+		offset = req->start;
+		if (keyset)
+		{
+			order = DJBHash((uint8_t *)orderBy, strlen(orderBy));
+			if (req->start && (last = get_page_mark(key, update_id, order, req->start)))
+			{
+				const char *op = sort.direction < 0 ? "<" : ">";
+				/* Bounding the first column on its own as well lets
+				 * SQLite seek in the index, expression or not */
+				sqlite3_snprintf(sizeof(where), where,
+				                 " and %s %s= (SELECT %s from OBJECTS where ID = ?2)"
+				                 " and (%s) %s (SELECT %s from OBJECTS where ID = ?2)",
+				                 first, op, first, keyset, op, keyset);
+				offset = 0;
+			}
 		}
 
-		ret = strcatf(str, "&lt;/container&gt;");
+		totalMatches = get_child_count(key);
+		sqlite3_snprintf(sizeof(sql), sql, "SELECT %s"
+				 "from OBJECTS where PARENT = ?1%s %s limit ?3, ?4", filter->columns,
+				 where, THISORNUL(orderBy));
 	}
 
-	(void)ret;
+	stmt = sql_prepare_cached(db, sql);
+	if( !stmt )
+	{
+		err = 709;
+		goto browse_error;
+	}
+	sqlite3_bind_int64(stmt, 1, key);
+	if( !metadata )
+	{
+		if( where[0] )
+			sqlite3_bind_int64(stmt, 2, last);
+		sqlite3_bind_int(stmt, 3, offset);
+		sqlite3_bind_int(stmt, 4, req->count);
+	}
+	DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s [%lld, %lld, %d, %d]\n",
+	        sql, (long long)key, (long long)last, offset, req->count);
+	ret = step_objects(stmt, &args);
+	if( ret != SQLITE_OK )
+	{
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", sqlite3_errmsg(db), sql);
+		err = 709;
+		goto browse_error;
+	}
+	if( metadata )
+		totalMatches = args.returned;
+	else if( keyset && args.returned )
+		set_page_mark(key, update_id, order, req->start + args.returned, args.last);
+
+browse_done:
+	if( didl_reserve(str, RESPONSE_TAIL, SIZE_MAX) != 0 )
+	{
+		err = 501;
+		goto browse_error;
+	}
+	ret = strcatf(str, "&lt;/DIDL-Lite&gt;</Result>\n"
+	                   "<NumberReturned>%u</NumberReturned>\n"
+	                   "<TotalMatches>%u</TotalMatches>\n"
+	                   "<UpdateID>%u</UpdateID>"
+	                   "</u:BrowseResponse>",
+	                   args.returned, totalMatches, update_id ? update_id : updateID);
+	*total = totalMatches;
+
+	/* Whatever is listed first in a folder is likely to be played next */
+	for( i = 0; hint && i < args.nitems; i++ )
+	{
+		if( !tree )
+			prefetch_hint_lookup("SELECT PATH from OBJECTS where ID = ?", args.items[i]);
+		else if( (node = objtree_lookup(tree, args.items[i])) )
+			prefetch_hint(objtree_path(tree, node));
+	}
+browse_error:
+	if( snapshot )
+		sql_exec_cached(db, "COMMIT", "");
+	objtree_put(tree);
+	free(orderBy);
+	if( err )
+	{
+		free(str->data);
+		str->data = NULL;
+	}
+
+	return err;
+}
+
+/* The TotalMatches of a BrowseResponse, which is in its last few bytes */
+static int
+response_total(const char *body, size_t len)
+{
+	static const char tag[] = "<TotalMatches>";
+	size_t i = len > RESPONSE_TAIL ? len - RESPONSE_TAIL : 0;
+
+	for (; i + sizeof(tag) <= len; i++)
+	{
+		if (memcmp(body + i, tag, sizeof(tag) - 1) == 0)
+			return atoi(body + i + sizeof(tag) - 1);
+	}
 
 	return 0;
 }
 
 static void
 BrowseContentDirectory(struct upnphttp * h, const char * action)
+{
+	char *ptr;
+	struct string_s str;
+	struct browse_request req;
+	struct filter filter;
+	char cache_key[BROWSE_CACHE_KEY_LEN];
+	size_t keylen = 0, cached_len;
+	uint32_t update_id;
+	int leader = 0;
+	int total = 0;
+	int ret;
+	struct NameValueParserData data;
+	int RequestedCount = 0;
+	int StartingIndex = 0;
+
+	memset(&str, 0, sizeof(str));
+
+	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+
+	req.object_id = GetValueFromNameValueList(&data, "ObjectID");
+	req.filter = GetValueFromNameValueList(&data, "Filter");
+	req.browse_flag = GetValueFromNameValueList(&data, "BrowseFlag");
+	req.sort = GetValueFromNameValueList(&data, "SortCriteria");
+
+	if( (ptr = GetValueFromNameValueList(&data, "RequestedCount")) )
+		RequestedCount = atoi(ptr);
+	if( RequestedCount < 0 )
+	{
+		SoapError(h, 402, "Invalid Args");
+		goto browse_error;
+	}
+	if( !RequestedCount )
+		RequestedCount = -1;
+	if( (ptr = GetValueFromNameValueList(&data, "StartingIndex")) )
+		StartingIndex = atoi(ptr);
+	if( StartingIndex < 0 )
+	{
+		SoapError(h, 402, "Invalid Args");
+		goto browse_error;
+	}
+	if( !req.browse_flag || (strcmp(req.browse_flag, "BrowseDirectChildren") && strcmp(req.browse_flag, "BrowseMetadata")) )
+	{
+		SoapError(h, 402, "Invalid Args");
+		goto browse_error;
+	}
+	if( !req.object_id && !(req.object_id = GetValueFromNameValueList(&data, "ContainerID")) )
+	{
+		SoapError(h, 402, "Invalid Args");
+		goto browse_error;
+	}
+	req.start = StartingIndex;
+	req.count = RequestedCount;
+	req.iface = h->iface;
+
+	get_filter(req.filter, &filter);
+	update_id = browse_update_id(req.object_id);
+	keylen = browse_cache_key(cache_key, req.object_id, req.browse_flag, req.start, req.count,
+	                          filter.flags, req.sort, req.iface);
+	/* Identical requests sent at the same moment, as when every renderer
+	 * refreshes on an SSDP alive, wait here for the first to be answered */
+	if( (ptr = browse_cache_get(cache_key, keylen, update_id, &cached_len, &leader)) )
+	{
+		BuildSendAndCloseSoapResp(h, ptr, cached_len);
+		precompute_note(h->clientaddr, &req, response_total(ptr, cached_len));
+		free(ptr);
+		goto browse_error;
+	}
+
+	ret = browse_response(&req, &filter, &str, &total, 1);
+	if( ret )
+	{
+		SoapError(h, ret, ret == 709 ? "Unsupported or invalid sort criteria" : "Action Failed");
+		goto browse_error;
+	}
+	browse_cache_put(cache_key, keylen, update_id, str.data, str.off);
+	leader = 0;
+	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	precompute_note(h->clientaddr, &req, total);
+
+browse_error:
+	if( leader )
+		browse_cache_abandon(cache_key, keylen);
+	ClearNameValueList(&data);
+	free(str.data);
+}
+
+void
+PrecomputeBrowse(struct browse_request *req)
+{
+	struct string_s str;
+	struct filter filter;
+	char cache_key[BROWSE_CACHE_KEY_LEN];
+	size_t keylen;
+	uint32_t update_id;
+	int total;
+
+	get_filter(req->filter, &filter);
+	update_id = browse_update_id(req->object_id);
+	keylen = browse_cache_key(cache_key, req->object_id, req->browse_flag, req->start, req->count,
+	                          filter.flags, req->sort, req->iface);
+	if( !browse_cache_claim(cache_key, keylen, update_id) )
+		return;
+	if( browse_response(req, &filter, &str, &total, 0) != 0 )
+	{
+		browse_cache_abandon(cache_key, keylen);
+		return;
+	}
+	browse_cache_put(cache_key, keylen, update_id, str.data, str.off);
+	free(str.data);
+}
+
+static void
+GetSearchCapabilities(struct upnphttp * h, const char * action)
+{
+	static const char resp[] =
+		"<u:%sResponse "
+		"xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+		"<SearchCaps>" SEARCH_CAPABILITIES "</SearchCaps>"
+		"</u:%sResponse>";
+	char body[512];
+	int bodylen;
+
+	bodylen = snprintf(body, sizeof(body), resp, action, action);
+	BuildSendAndCloseSoapResp(h, body, bodylen);
+}
+
+static void
+GetSortCapabilities(struct upnphttp * h, const char * action)
+{
+	static const char resp[] =
+		"<u:%sResponse "
+		"xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+		"<SortCaps>" SORT_CAPABILITIES "</SortCaps>"
+		"</u:%sResponse>";
+	char body[512];
+	int bodylen;
+
+	bodylen = snprintf(body, sizeof(body), resp, action, action);
+	BuildSendAndCloseSoapResp(h, body, bodylen);
+}
+
+static void
+SearchContentDirectory(struct upnphttp * h, const char * action)
 {
 	static const char resp0[] =
-			"<u:BrowseResponse "
+			"<u:SearchResponse "
 			"xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
 			"<Result>"
 			"&lt;DIDL-Lite"
 			CONTENT_DIRECTORY_SCHEMAS;
 	char *zErrMsg = NULL;
-	char *sql, *ptr;
+	char *sql = NULL, *ptr;
 	struct Response args;
 	struct string_s str;
-	int totalMatches = 0;
+	int totalMatches;
 	int ret;
-	const char *ObjectID, *BrowseFlag;
-	char *Filter, *SortCriteria;
-	char where[256] = "";
-	char *orderBy = NULL;
+	const char *ContainerID;
+	char *Filter, *SearchCriteria, *SortCriteria;
+	char *criteria = NULL, *where = NULL, *scope = NULL;
+	struct sort_order sort;
+	struct filter filter;
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
+	int64_t key;
+	uint32_t update_id;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
 
 	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
 
-	ObjectID = GetValueFromNameValueList(&data, "ObjectID");
+	ContainerID = GetValueFromNameValueList(&data, "ContainerID");
 	Filter = GetValueFromNameValueList(&data, "Filter");
-	BrowseFlag = GetValueFromNameValueList(&data, "BrowseFlag");
+	SearchCriteria = GetValueFromNameValueList(&data, "SearchCriteria");
 	SortCriteria = GetValueFromNameValueList(&data, "SortCriteria");
 
 	if( (ptr = GetValueFromNameValueList(&data, "RequestedCount")) )
@@ -324,7 +1053,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	if( RequestedCount < 0 )
 	{
 		SoapError(h, 402, "Invalid Args");
-		goto browse_error;
+		goto search_error;
 	}
 	if( !RequestedCount )
 		RequestedCount = -1;
@@ -333,91 +1062,97 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	if( StartingIndex < 0 )
 	{
 		SoapError(h, 402, "Invalid Args");
-		goto browse_error;
+		goto search_error;
 	}
-	if( !BrowseFlag || (strcmp(BrowseFlag, "BrowseDirectChildren") && strcmp(BrowseFlag, "BrowseMetadata")) )
+	if( !ContainerID && !(ContainerID = GetValueFromNameValueList(&data, "ObjectID")) )
 	{
 		SoapError(h, 402, "Invalid Args");
-		goto browse_error;
+		goto search_error;
 	}
-	if( !ObjectID && !(ObjectID = GetValueFromNameValueList(&data, "ContainerID")) )
+
+	key = object_key(db, ContainerID, NULL, 0);
+	if( key < 0 )
 	{
-		SoapError(h, 402, "Invalid Args");
-		goto browse_error;
+		SoapError(h, 710, "No such container");
+		goto search_error;
+	}
+	/* which changes with anything below the container */
+	update_id = get_update_id(key);
+	criteria = unescape_tag(SearchCriteria ? SearchCriteria : "*", 1);
+	if( criteria )
+		where = search_criteria_sql(criteria, search_fts);
+	if( !where )
+	{
+		SoapError(h, 708, "Unsupported or invalid search criteria");
+		goto search_error;
+	}
+	if( parse_sort_criteria(SortCriteria, &sort) != 0 && GETFLAG(DLNA_STRICT_MASK) )
+	{
+		SoapError(h, 709, "Unsupported or invalid sort criteria");
+		goto search_error;
 	}
+	/* Everything below the container */
+	if( strcmp(ContainerID, "0") == 0 )
+		scope = sqlite3_mprintf("PARENT != 0");
+	else
+		scope = sqlite3_mprintf("ID in (WITH RECURSIVE SUBTREE(ID) as ("
+		                        "SELECT ID from OBJECTS where PARENT = %lld UNION ALL "
+		                        "SELECT o.ID from OBJECTS o, SUBTREE where o.PARENT = SUBTREE.ID) "
+		                        "SELECT ID from SUBTREE)", (long long)key);
 
 	str.data = malloc(DEFAULT_RESP_SIZE);
 	str.size = DEFAULT_RESP_SIZE;
 	str.off = sprintf(str.data, "%s", resp0);
-	/* See if we need to include DLNA namespace reference */
-	args.iface = h->iface;
-	args.filter = set_filter_flags(Filter);
+	get_filter(Filter, &filter);
+	didl_init(&args.didl, &str, MAX_RESPONSE_SIZE, filter.flags,
+	          lan_addr[h->iface].str, runtime_vars.port);
 	strcatf(&str, "&gt;\n");
 
-	args.returned = 0;
 	args.requested = RequestedCount;
-	args.flags = 0;
-	args.str = &str;
-	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
+	DPRINTF(E_DEBUG, L_HTTP, "Searching ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
 	                         " * StartingIndex: %d\n"
-	                         " * BrowseFlag: %s\n"
+	                         " * SearchCriteria: %s\n"
 	                         " * Filter: %s\n"
 	                         " * SortCriteria: %s\n",
-				ObjectID, RequestedCount, StartingIndex,
-	                        BrowseFlag, Filter, SortCriteria);
+				ContainerID, RequestedCount, StartingIndex,
+	                        criteria, Filter, SortCriteria);
 
-	if( strcmp(BrowseFlag+6, "Metadata") == 0 )
+	totalMatches = sql_get_int_field(db, "SELECT count(*) from OBJECTS where %s and (%s)", scope, where);
+	sql = sqlite3_mprintf("SELECT %s"
+	                      "from OBJECTS where %s and (%s) order by %s%sID%s limit %d, %d;",
+	                      filter.columns, scope, where, sort.terms, sort.terms[0] ? ", " : "",
+	                      sort.direction < 0 ? " desc" : "", StartingIndex, RequestedCount);
+	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s\n", sql);
+	ret = list_objects(sql, &args, &zErrMsg);
+	if( ret != SQLITE_OK )
 	{
-		const char *id = ObjectID;
-		args.requested = 1;
-		sql = sqlite3_mprintf("SELECT OBJECT_ID, PARENT_ID, " COLUMNS
-				"from OBJECTS where OBJECT_ID = '%q';", id);
-		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
-		totalMatches = args.returned;
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", THISORNUL(zErrMsg), sql);
+		sqlite3_free(zErrMsg);
+		SoapError(h, 708, "Unsupported or invalid search criteria");
+		goto search_error;
 	}
-	else
-	{
-		if (!where[0])
-			sqlite3_snprintf(sizeof(where), where, "PARENT_ID = '%q'", ObjectID);
-
-		if (!totalMatches)
-			totalMatches = get_child_count(ObjectID);
-		ret = 0;
 
-		/* If it's a DLNA client, return an error for bad sort criteria */
-		if(GETFLAG(DLNA_STRICT_MASK))
-		{
-			SoapError(h, 709, "Unsupported or invalid sort criteria");
-			goto browse_error;
-		}
-
-		sql = sqlite3_mprintf("SELECT OBJECT_ID, PARENT_ID, " COLUMNS
-				      "from OBJECTS where %s %s limit %d, %d;", where, THISORNUL(orderBy), StartingIndex, RequestedCount);
-		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
-	}
-	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
+	if( didl_reserve(&str, RESPONSE_TAIL, SIZE_MAX) != 0 )
 	{
-		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
-		sqlite3_free(zErrMsg);
-		SoapError(h, 709, "Unsupported or invalid sort criteria");
-		goto browse_error;
+		SoapError(h, 501, "Action Failed");
+		goto search_error;
 	}
-	sqlite3_free(sql);
-
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
 	                    "<NumberReturned>%u</NumberReturned>\n"
 	                    "<TotalMatches>%u</TotalMatches>\n"
 	                    "<UpdateID>%u</UpdateID>"
-	                    "</u:BrowseResponse>",
-	                    args.returned, totalMatches, updateID);
+	                    "</u:SearchResponse>",
+	                    args.returned, totalMatches > 0 ? totalMatches : 0,
+	                    update_id ? update_id : updateID);
 	BuildSendAndCloseSoapResp(h, str.data, str.off);
-browse_error:
+search_error:
 	ClearNameValueList(&data);
-	free(orderBy);
+	sqlite3_free(sql);
+	sqlite3_free(scope);
+	sqlite3_free(where);
+	free(criteria);
 	free(str.data);
 }
 
@@ -429,6 +1164,9 @@ static const struct
 soapMethods[] =
 {
 	{ "Browse", BrowseContentDirectory},
+	{ "Search", SearchContentDirectory},
+	{ "GetSearchCapabilities", GetSearchCapabilities},
+	{ "GetSortCapabilities", GetSortCapabilities},
 	{ 0, 0 }
 };
 
@@ -21,8 +21,13 @@
 #ifndef __UPNPSOAP_H__
 #define __UPNPSOAP_H__
 
+#include "didl.h"
+#include "prefetch.h"
+
 #define DEFAULT_RESP_SIZE 131072
 #define MAX_RESPONSE_SIZE 2097152
+/* Room for what follows the DIDL-Lite in a response */
+#define RESPONSE_TAIL 512
 
 #define CONTENT_DIRECTORY_SCHEMAS \
 	" xmlns:dc=\"http://purl.org/dc/elements/1.1/\"" \
@@ -35,19 +40,41 @@
 
 struct Response
 {
-	struct string_s *str;
+	struct didl_writer didl;
+	const char *parent_id;
 	int start;
 	int returned;
 	int requested;
-	int iface;
-	uint32_t filter;
+	int full;
+	int64_t last;
+	/* the first items written, to prefetch */
+	int64_t items[PREFETCH_BROWSE_ITEMS];
+	int nitems;
 	uint32_t flags;
 };
 
+/* A Browse request, as the arguments it came with */
+struct browse_request
+{
+	const char *object_id;
+	const char *browse_flag;
+	const char *filter;
+	char *sort;
+	int start;
+	int count;	/* -1 for all */
+	int iface;	/* the interface it came in on */
+};
+
 /* ExecuteSoapAction():
  * this method executes the requested Soap Action */
 void
 ExecuteSoapAction(struct upnphttp *, const char *, int);
 
+/* PrecomputeBrowse():
+ * builds the response to a Browse request a client has yet to make into
+ * the browse cache, unless it is there already or being built */
+void
+PrecomputeBrowse(struct browse_request *req);
+
 #endif
 
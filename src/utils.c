@@ -29,6 +29,7 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "minidlnatypes.h"
 #include "upnpglobalvars.h"
@@ -322,6 +323,87 @@ DJBHash(uint8_t *data, int len)
 	return hash;
 }
 
+/* Send a message along with up to UTILS_MAX_FDS file descriptors over a
+ * UNIX domain socket. */
+int
+send_fds(int s, const void *buf, size_t len, const int *fds, int nfds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * UTILS_MAX_FDS)];
+	} ctl;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	if (nfds < 0 || nfds > UTILS_MAX_FDS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds)
+	{
+		memset(&ctl, 0, sizeof(ctl));
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+	do {
+		n = sendmsg(s, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+
+	return (n == (ssize_t)len) ? 0 : -1;
+}
+
+/* Receive a message sent by send_fds().  On return *nfds holds the number
+ * of descriptors stored in fds, which must have room for UTILS_MAX_FDS. */
+ssize_t
+recv_fds(int s, void *buf, size_t len, int *fds, int *nfds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * UTILS_MAX_FDS)];
+	} ctl;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	*nfds = 0;
+	do {
+		n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return n;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+	}
+
+	return n;
+}
+
 const char *
 mime_to_ext(const char * mime)
 {
@@ -98,5 +98,8 @@ const char *mime_to_ext(const char * mime);
 /* Others */
 int make_dir(char * path, mode_t mode);
 unsigned int DJBHash(uint8_t *data, int len);
+#define UTILS_MAX_FDS 8
+int send_fds(int s, const void *buf, size_t len, const int *fds, int nfds);
+ssize_t recv_fds(int s, void *buf, size_t len, int *fds, int *nfds);
 
 #endif
@@ -0,0 +1,165 @@
+/* Microbenchmark of DIDL-Lite rendering: rows per second through the DIDL
+ * writer, with and without fragments stored at scan time, against the
+ * strcatf() callback it replaced.
+ *
+ * Build with "make bench_didl", then run ./bench_didl [rows-per-page]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "minidlnatypes.h"
+#include "utils.h"
+#include "didl.h"
+
+#define ROWS		10000
+#define PAGES		2000
+#define RESP_SIZE	131072
+#define MAX_SIZE	2097152
+
+struct row {
+	char id[32];
+	char key[16];
+	char title[128];
+	char escaped[256];	/* what titles were stored as before */
+	char size[24];
+	int64_t n_key, n_size;	/* as SQLite hands them over now */
+	const char *class;
+	const char *mime;
+	char *didl;
+};
+
+static struct row rows[ROWS];
+
+static const char *titles[] = {
+	"bbb_sunflower_1080p_30fps_normal",
+	"Tom & Jerry - The \"Classic\" Collection",
+	"Justice.League.Dark.Apokolips.War.2020.1080p.WEBRip.x264-RARBG",
+	"<Untitled>",
+};
+
+static const char *mimes[] = { "video/mp4", "video/x-matroska", "video/avi" };
+
+/* The old callback: one strcatf() per fragment and the MIME type looked up
+ * for every row */
+static void
+legacy_add_res(struct string_s *str, const struct row *r)
+{
+	const char *ext = mime_to_ext(r->mime);
+
+	strcatf(str, "&lt;res ");
+	strcatf(str, "size=\"%s\" ", r->size);
+	strcatf(str, "protocolInfo=\"http-get:*:%s:%s\"&gt;"
+	             "http://%s:%d/MediaItems/%s.%s"
+	             "&lt;/res&gt;",
+	             r->mime, "*", "192.168.1.11", 8200, r->key, ext);
+}
+
+static void
+legacy_row(struct string_s *str, const struct row *r)
+{
+	strcatf(str, "&lt;item id=\"%s\" parentID=\"%s\" restricted=\"1\"", r->id, "64$0");
+	strcatf(str, "&gt;"
+	             "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
+	             "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
+	             r->escaped, r->class);
+	legacy_add_res(str, r);
+	strcatf(str, "&lt;/item&gt;");
+}
+
+static void
+didl_row(struct didl_writer *w, const struct row *r, int stored)
+{
+	struct didl_object obj = {
+		.id = r->id,
+		.parent_id = "64$0",
+		.key = r->n_key,
+		.class = r->class,
+		.title = r->title,
+		.mime = r->mime,
+		.size = r->n_size,
+		.child_count = -1,
+		.storage_used = -1,
+		.didl = stored ? r->didl : NULL,
+	};
+
+	didl_write(w, &obj);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct string_s str;
+	struct didl_writer w;
+	int per_page = argc > 1 ? atoi(argv[1]) : 50;
+	double start, legacy, writer[2];
+	size_t legacy_len = 0, writer_len[2] = { 0, 0 };
+	char *esc;
+	int i, p, n, stored;
+
+	if (per_page <= 0 || per_page > ROWS)
+		per_page = 50;
+	for (i = 0; i < ROWS; i++)
+	{
+		snprintf(rows[i].id, sizeof(rows[i].id), "64$0$%X", i);
+		snprintf(rows[i].key, sizeof(rows[i].key), "%d", i + 4);
+		snprintf(rows[i].title, sizeof(rows[i].title), "%s %d", titles[i % 4], i);
+		esc = escape_tag(rows[i].title, 1);
+		snprintf(rows[i].escaped, sizeof(rows[i].escaped), "%s", esc);
+		free(esc);
+		snprintf(rows[i].size, sizeof(rows[i].size), "%lld", 1000000LL * (i + 1));
+		rows[i].n_key = i + 4;
+		rows[i].n_size = 1000000LL * (i + 1);
+		rows[i].class = "item.videoItem";
+		rows[i].mime = mimes[(i / 100) % 3];
+		rows[i].didl = didl_fragment(rows[i].class, rows[i].title, rows[i].mime, rows[i].size);
+	}
+
+	str.data = malloc(RESP_SIZE);
+	str.size = RESP_SIZE;
+
+	start = now();
+	for (p = 0; p < PAGES; p++)
+	{
+		str.off = 0;
+		for (i = 0, n = p * per_page; i < per_page; i++, n++)
+			legacy_row(&str, &rows[n % ROWS]);
+		legacy_len += str.off;
+	}
+	legacy = now() - start;
+
+	for (stored = 0; stored < 2; stored++)
+	{
+		start = now();
+		for (p = 0; p < PAGES; p++)
+		{
+			str.off = 0;
+			didl_init(&w, &str, MAX_SIZE, STANDARD_FILTER_MASK, "192.168.1.11", 8200);
+			for (i = 0, n = p * per_page; i < per_page; i++, n++)
+				didl_row(&w, &rows[n % ROWS], stored);
+			writer_len[stored] += str.off;
+		}
+		writer[stored] = now() - start;
+	}
+
+	printf("%d pages of %d rows\n", PAGES, per_page);
+	printf("strcatf callback:    %10.0f rows/s, %zu bytes\n", PAGES * per_page / legacy, legacy_len);
+	printf("DIDL writer:         %10.0f rows/s, %zu bytes\n", PAGES * per_page / writer[0], writer_len[0]);
+	printf("  stored fragments:  %10.0f rows/s, %zu bytes\n", PAGES * per_page / writer[1], writer_len[1]);
+	free(str.data);
+	for (i = 0; i < ROWS; i++)
+		free(rows[i].didl);
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/* Microbenchmark of the object tree: time per Browse page of a large
+ * container, looked up and listed through the prepared statements Browse
+ * used before, seeking to the page as if from a page mark, against the
+ * same page off the object tree.  Also the time to build the tree, and to
+ * map it from the catalog at the next start.
+ *
+ * Build with "make bench_objtree", then run ./bench_objtree [rows-per-page]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "config.h"
+#include "upnpglobalvars.h"
+#include "sql.h"
+#include "objectid.h"
+#include "objtree.h"
+#include "scanner_sqlite.h"
+
+#define ROWS	50000
+#define PAGES	20000
+
+/* db_upgrade() is not run, so the scanner is left out */
+int CreateIndexes(sqlite3 *db) { return 0; }
+int CreateSearchIndex(sqlite3 *db) { return 0; }
+int CreateSettings(sqlite3 *db) { return 0; }
+int CountContainerTotals(sqlite3 *db) { return 0; }
+int UpgradeObjectKeys(sqlite3 *db) { return 0; }
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	int per_page = argc > 1 ? atoi(argv[1]) : 50;
+	double start, build, load, before, after;
+	char dir[] = "/tmp/bench_objtree.XXXXXX";
+	const struct objtree_node *node, *children;
+	struct didl_object obj;
+	struct objtree *tree;
+	sqlite3_stmt *stmt;
+	char id[OBJECT_ID_LEN];
+	int64_t key, sum = 0;
+	int i, p, count;
+
+	if (per_page <= 0 || per_page > ROWS)
+		per_page = 50;
+	if (sqlite3_open(":memory:", &db) != SQLITE_OK)
+		return 1;
+	sql_exec(db, create_objectTable_sqlite);
+	sql_exec(db, create_objectIndexes_sqlite);
+	sql_exec(db, create_settingsTable_sqlite);
+	if (!mkdtemp(dir))
+		return 1;
+	snprintf(db_path, PATH_MAX, "%s", dir);
+
+	/* "0", "64", "64$0" and the rows in it */
+	sql_exec(db, "BEGIN");
+	sql_exec(db, "INSERT into OBJECTS (PARENT, IDX, CLASS, TITLE, CHILD_COUNT, STORAGE_USED) "
+	             "VALUES (0, 0, 'container.storageFolder', 'root', 1, 0), "
+	             "(1, 0x64, 'container.storageFolder', 'Video', 1, 0), "
+	             "(2, 0, 'container.storageFolder', 'Movies', %d, 0)", ROWS);
+	for (i = 0; i < ROWS; i++)
+		sql_exec_cached(db, "INSERT into OBJECTS (PARENT, IDX, CLASS, PATH, SIZE, TITLE, MIME, DIDL) "
+		                    "VALUES (3, ?, 'item.videoItem', '/media/video/file.mp4', ?, ?, 'video/mp4', ?)",
+		                "iItt", i, (int64_t)i * 1000, "Tom & Jerry's",
+		                "&gt;&lt;dc:title&gt;Tom &amp;amp; Jerry's&lt;/dc:title&gt;");
+	sql_exec(db, "COMMIT");
+
+	runtime_vars.object_tree = 1;
+	start = now();
+	if (objtree_build(db) != 0)
+		return 1;
+	build = now() - start;
+	objtree_shutdown();
+	start = now();
+	if (objtree_load(db) != 0)
+		return 1;
+	load = now() - start;
+	tree = objtree_get();
+
+	/* Browse's lookup of the container and the page after it */
+	start = now();
+	for (p = 0; p < PAGES; p++)
+	{
+		key = object_key(db, "64$0", id, sizeof(id));
+		sum += sql_get_int_cached(db, "SELECT CHILD_COUNT from OBJECTS where ID = ?", "I", key);
+		stmt = sql_bind_cached(db, "SELECT IDX, ID, CLASS, SIZE, TITLE, MIME, CHILD_COUNT, "
+		                           "STORAGE_USED, DIDL from OBJECTS where PARENT = ? and IDX >= ? "
+		                           "order by IDX limit ?", "Iii",
+		                       key, (p * per_page) % ROWS, per_page);
+		while (stmt && sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			sum += sqlite3_column_int64(stmt, 3);
+			sum += sqlite3_column_text(stmt, 8) != NULL;
+		}
+		sqlite3_reset(stmt);
+	}
+	before = now() - start;
+
+	start = now();
+	for (p = 0; p < PAGES; p++)
+	{
+		node = objtree_find(tree, "64$0", id, sizeof(id));
+		sum -= node->child_count;
+		children = objtree_children(tree, node, &count);
+		for (i = (p * per_page) % ROWS; i < count && i < (p * per_page) % ROWS + per_page; i++)
+		{
+			objtree_object(tree, &children[i], &obj);
+			sum -= obj.size;
+			sum -= obj.didl != NULL;
+		}
+	}
+	after = now() - start;
+
+	printf("%d objects, tree built in %.1f ms, mapped in %.3f ms\n", ROWS, build * 1e3, load * 1e3);
+	printf("page of %d: %8.0f ns -> %6.0f ns (%.1fx)\n", per_page,
+	       before * 1e9 / PAGES, after * 1e9 / PAGES, before / after);
+
+	objtree_put(tree);
+	objtree_shutdown();
+	sql_finalize_cached(db);
+	sqlite3_close(db);
+	snprintf(db_path, PATH_MAX, "%s/files.catalog", dir);
+	unlink(db_path);
+	rmdir(dir);
+
+	/* Both ways must have found the same */
+	return sum != 0;
+}
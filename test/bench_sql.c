@@ -0,0 +1,125 @@
+/* Microbenchmark of the SQL helpers: time per call of the lookups and
+ * inserts the daemon makes most, formatted and prepared on every call as
+ * sql_get_int_field(), sql_get_table() and sql_exec() do, against kept
+ * prepared statements from the statement cache.
+ *
+ * Build with "make bench_sql", then run ./bench_sql [calls]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "upnpglobalvars.h"
+#include "sql.h"
+#include "scanner_sqlite.h"
+
+#define ROWS	100000
+
+/* db_upgrade() is not run, so the scanner is left out */
+int CreateIndexes(sqlite3 *db) { return 0; }
+int CreateSearchIndex(sqlite3 *db) { return 0; }
+int CreateSettings(sqlite3 *db) { return 0; }
+int CountContainerTotals(sqlite3 *db) { return 0; }
+int UpgradeObjectKeys(sqlite3 *db) { return 0; }
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *what, double before, double after, int calls)
+{
+	printf("%-22s %8.0f ns -> %6.0f ns per call (%.1fx)\n", what,
+	       before * 1e9 / calls, after * 1e9 / calls, before / after);
+}
+
+int
+main(int argc, char **argv)
+{
+	int calls = argc > 1 ? atoi(argv[1]) : 200000;
+	double start, before, after;
+	char **result;
+	sqlite3_stmt *stmt;
+	int64_t sum = 0;
+	int i, rows;
+
+	if (calls <= 0)
+		calls = 200000;
+	if (sqlite3_open(":memory:", &db) != SQLITE_OK)
+		return 1;
+	sql_exec(db, create_objectTable_sqlite);
+
+	/* Inserts, as the scanner makes them */
+	sql_exec(db, "BEGIN");
+	start = now();
+	for (i = 0; i < ROWS; i++)
+		sql_exec(db, "INSERT into OBJECTS (PARENT, IDX, CLASS, PATH, SIZE, TITLE, MIME) "
+		             "VALUES (%lld, %d, '%s', %Q, %lld, '%q', '%q')",
+		             (long long)(i / 100), i % 100, "item.videoItem", "/media/video/file.mp4",
+		             (long long)i * 1000, "Tom & Jerry's", "video/mp4");
+	before = now() - start;
+	sql_exec(db, "DELETE from OBJECTS");
+	start = now();
+	for (i = 0; i < ROWS; i++)
+		sql_exec_cached(db, "INSERT into OBJECTS (PARENT, IDX, CLASS, PATH, SIZE, TITLE, MIME) "
+		                    "VALUES (?, ?, ?, ?, ?, ?, ?)",
+		                "IittItt", (int64_t)(i / 100), i % 100, "item.videoItem", "/media/video/file.mp4",
+		                (int64_t)i * 1000, "Tom & Jerry's", "video/mp4");
+	after = now() - start;
+	sql_exec(db, "COMMIT");
+	report("insert", before, after, ROWS);
+
+	/* Integer lookups, as Browse makes for the child count */
+	start = now();
+	for (i = 0; i < calls; i++)
+		sum += sql_get_int_field(db, "SELECT SIZE from OBJECTS where ID = %lld;",
+		                         (long long)(i % ROWS + 1));
+	before = now() - start;
+	start = now();
+	for (i = 0; i < calls; i++)
+		sum -= sql_get_int_cached(db, "SELECT SIZE from OBJECTS where ID = ?", "I",
+		                          (int64_t)(i % ROWS + 1));
+	after = now() - start;
+	report("int lookup", before, after, calls);
+
+	/* Row lookups, as file serving makes for the path */
+	start = now();
+	for (i = 0; i < calls; i++)
+	{
+		char sql[128];
+
+		snprintf(sql, sizeof(sql), "SELECT PATH, MIME, SIZE from OBJECTS where ID = '%lld'",
+		         (long long)(i % ROWS + 1));
+		if (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK)
+		{
+			if (rows)
+				sum += strtoll(result[5], NULL, 10);
+			sqlite3_free_table(result);
+		}
+	}
+	before = now() - start;
+	start = now();
+	for (i = 0; i < calls; i++)
+	{
+		stmt = sql_bind_cached(db, "SELECT PATH, MIME, SIZE from OBJECTS where ID = ?", "I",
+		                       (int64_t)(i % ROWS + 1));
+		if (stmt && sqlite3_step(stmt) == SQLITE_ROW)
+			sum -= sqlite3_column_int64(stmt, 2);
+		sqlite3_reset(stmt);
+	}
+	after = now() - start;
+	report("row lookup", before, after, calls);
+
+	sql_finalize_cached(db);
+	sqlite3_close(db);
+
+	/* Both ways must have found the same */
+	return sum != 0;
+}